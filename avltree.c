@@ -1,9 +1,20 @@
 /*
-    avltree.c - v2.0.0
+    avltree.c - v2.1.0
     AVL tree implementation in C.
     Copyright (C) 2025  João Manica  <joaoedisonmanica@gmail.com>
 
     History:
+        v2.1.0  Node allocators and slab pools, single descent insertion,
+                comparator counter (AVLTREE_STATS), iterative traversal,
+                cursors, bounds and range queries, order statistics
+                (AVLTREE_SIZE), bulk loading, set algebra,
+                split and join, typed trees (AVLTREE_DEFINE), compact
+                nodes (AVLTREE_COMPACT, AVLTREE_NO_VALUE), frozen snapshots,
+                SIMD batched lookups of int64_t keys, persistent trees,
+                parallel bulk operations, operation statistics
+                (avltree_stats) and probes, binary snapshots, wide
+                nodes (avltree_create_wide), multisets (AVLTREE_COUNT),
+                avltree_upsert(), range aggregates (AVLTREE_AGG_TYPE).
         v2.0.0  avl_diff(), avl_copy_keys(), flags parameter in avl_remove,
                 stream pointer parameter and separator string in printing
                 routines.
@@ -22,356 +33,3321 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 
 #include "avltree.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define AVL_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define AVL_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Slab header, padded so the nodes that follow stay aligned. */
+struct avltree_slab {
+    struct avltree_slab *next;
+    long double align;
+};
+
+#define SLAB_HEADER offsetof(struct avltree_slab, align)
+
+#ifdef AVLTREE_STATS
+#define AVL_STAT(T, FIELD, N) ((T)->stats.FIELD += (N))
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AVL_PROBE2(NAME, A, B) DTRACE_PROBE2(avltree, NAME, A, B)
+#endif
+#endif
+#else
+#define AVL_STAT(T, FIELD, N) ((void)0)
+#endif
+#ifndef AVL_PROBE2
+#define AVL_PROBE2(NAME, A, B) ((void)0)
+#endif
+
+#define AVL_COMPAR(T, A, B) (AVL_STAT(T, compar, 1), (T)->compar(A, B))
+/* A rotation in retrace() or rebalance(): 1 single, 2 double. */
+#define AVL_ROTATED(T, KIND) \
+    do { \
+        if ((KIND) == 1) \
+            AVL_STAT(T, single_rotations, 1); \
+        else \
+            AVL_STAT(T, double_rotations, 1); \
+        AVL_PROBE2(rotation, T, KIND); \
+    } while (0)
+
+#ifdef AVLTREE_SIZE
+#define AVL_SIZE(N) ((N)? (N)->size : 0)
+#define AVL_AUGMENTED
+#endif
+#ifdef AVLTREE_AGG_TYPE
+#define AVL_AGG(T, N) ((N)? (N)->agg : (T)->agg.identity)
+#define AVL_AUGMENTED
+#endif
+
+#define AVL_BULK(T) ((T)->alloc && (T)->alloc->release)
+
+static void pool_release(pool)
+void *pool;
+{
+    avltree_pool_destroy(pool);
+}
+
+void avltree_pool_init(p, size, nperslab, shared)
+avltree_pool *p;
+size_t size, nperslab;
+unsigned char shared;
+{
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    p->size = size;
+    p->nperslab = nperslab? nperslab : 1024;
+    p->slabs = NULL;
+    p->free_list = NULL;
+    p->next = p->end = NULL;
+    p->allocator.alloc = avltree_pool_alloc;
+    p->allocator.free = avltree_pool_free;
+    p->allocator.release = shared? NULL : pool_release;
+    p->allocator.ctx = p;
+}
+
+/* Frees every slab; the pool stays usable. */
+void avltree_pool_destroy(p)
+avltree_pool *p;
+{
+    struct avltree_slab *s, *next;
+
+    for (s = p->slabs; s; s = next) {
+        next = s->next;
+        free(s);
+    }
+    p->slabs = NULL;
+    p->free_list = NULL;
+    p->next = p->end = NULL;
+}
+
+/* Makes room for N nodes in a single slab. */
+void avltree_pool_reserve(p, n)
+avltree_pool *p;
+size_t n;
+{
+    struct avltree_slab *s;
+
+    /* Keeps what is left of the current slab. */
+    for (; p->next && p->next < p->end; p->next += p->size)
+        avltree_pool_free(p, p->next);
+    if (!(s = malloc(SLAB_HEADER + p->size * n)))
+        return;
+    s->next = p->slabs;
+    p->slabs = s;
+    p->next = (unsigned char *)s + SLAB_HEADER;
+    p->end = p->next + p->size * n;
+}
+
+void *avltree_pool_alloc(pool, size)
+void *pool;
+size_t size;
+{
+    avltree_pool *p;
+    struct avltree_slab *s;
+    void *ptr;
+
+    p = pool;
+    assert(size <= p->size);
+    if ((ptr = p->free_list)) {
+        p->free_list = *(void **)ptr;
+        return ptr;
+    }
+    if (p->next == p->end) {
+        if (!(s = malloc(SLAB_HEADER + p->size * p->nperslab)))
+            return NULL;
+        s->next = p->slabs;
+        p->slabs = s;
+        p->next = (unsigned char *)s + SLAB_HEADER;
+        p->end = p->next + p->size * p->nperslab;
+    }
+    ptr = p->next;
+    p->next += p->size;
+    return ptr;
+}
+
+void avltree_pool_free(pool, ptr)
+void *pool, *ptr;
+{
+    avltree_pool *p;
+
+    p = pool;
+    *(void **)ptr = p->free_list;
+    p->free_list = ptr;
+}
+
+void *avl_alloc_node(t, size)
+avltree_tree *t;
+size_t size;
+{
+    void *n;
+
+    n = t->alloc? t->alloc->alloc(t->alloc->ctx, size) : malloc(size);
+    AVL_STAT(t, allocs, 1);
+    AVL_PROBE2(alloc, t, n);
+    return n;
+}
+
+static void free_node(t, r)
+avltree_tree *t;
+avltree_node *r;
+{
+    AVL_STAT(t, frees, 1);
+    AVL_PROBE2(free, t, r);
+    if (t->alloc)
+        t->alloc->free(t->alloc->ctx, r);
+    else
+        free(r);
+}
+
+/* Wide trees: */
+
+/* B-tree of minimum degree WIDE_T: nodes other than the root hold between
+   WIDE_T - 1 and WIDE_MAX keys, and internal nodes one child more. Keys sit
+   apart from values so an in-node search touches only their cache lines. */
+#ifndef AVLTREE_WIDE_T
+#define AVLTREE_WIDE_T 16
+#endif
+#define WIDE_T AVLTREE_WIDE_T
+#define WIDE_MAX (2 * WIDE_T - 1)
+
+typedef struct avltree_wide {
+    void *key[WIDE_MAX];
+    struct avltree_wide *child[WIDE_MAX + 1];
+    void *value[WIDE_MAX];
+    int n;
+    unsigned char leaf;
+} avltree_wide;
+
+static avltree_wide *wide_node(leaf)
+unsigned char leaf;
+{
+    avltree_wide *x;
+
+    /* Cache line aligned. */
+    x = aligned_alloc(64, (sizeof(avltree_wide) + 63) & ~(size_t)63);
+    x->n = 0;
+    x->leaf = leaf;
+    return x;
+}
+
+/* Index of the first key of x >= KEY. */
+static wide_search(t, x, key)
+avltree_tree *t;
+avltree_wide *x;
+void *key;
+{
+    int lo, hi, mid;
+
+    AVL_STAT(t, visited, 1);
+    for (lo = 0, hi = x->n; lo < hi; )
+        if (AVL_COMPAR(t, key, x->key[mid = (lo + hi) / 2]) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    return lo;
+}
+
+/* Moves the keys, values and children of x from I on by D places. */
+static void wide_shift(x, i, d)
+avltree_wide *x;
+{
+    memmove(x->key + i + d, x->key + i, sizeof(void *) * (x->n - i));
+    memmove(x->value + i + d, x->value + i, sizeof(void *) * (x->n - i));
+    if (!x->leaf)
+        memmove(x->child + i + 1 + d, x->child + i + 1, sizeof(void *) * (x->n - i));
+    x->n += d;
+}
+
+/* Splits the full child i of x around its median, which goes up to x. */
+static void wide_split(x, i)
+avltree_wide *x;
+{
+    avltree_wide *y, *z;
+
+    y = x->child[i];
+    z = wide_node(y->leaf);
+    z->n = WIDE_T - 1;
+    memcpy(z->key, y->key + WIDE_T, sizeof(void *) * (WIDE_T - 1));
+    memcpy(z->value, y->value + WIDE_T, sizeof(void *) * (WIDE_T - 1));
+    if (!y->leaf)
+        memcpy(z->child, y->child + WIDE_T, sizeof(void *) * WIDE_T);
+    y->n = WIDE_T - 1;
+    wide_shift(x, i, 1);
+    x->key[i] = y->key[WIDE_T - 1];
+    x->value[i] = y->value[WIDE_T - 1];
+    x->child[i + 1] = z;
+}
+
+/* Merges child i + 1 of x and key i into child i. */
+static void wide_merge(x, i)
+avltree_wide *x;
+{
+    avltree_wide *y, *z;
+
+    y = x->child[i];
+    z = x->child[i + 1];
+    y->key[y->n] = x->key[i];
+    y->value[y->n] = x->value[i];
+    memcpy(y->key + y->n + 1, z->key, sizeof(void *) * z->n);
+    memcpy(y->value + y->n + 1, z->value, sizeof(void *) * z->n);
+    if (!y->leaf)
+        memcpy(y->child + y->n + 1, z->child, sizeof(void *) * (z->n + 1));
+    y->n += z->n + 1;
+    free(z);
+    wide_shift(x, i + 1, -1);
+}
+
+/* Gives child i of x at least WIDE_T keys, from a sibling or by merging.
+   Returns the index of the child that now holds its keys. */
+static wide_fill(x, i)
+avltree_wide *x;
+{
+    avltree_wide *c, *s;
+
+    c = x->child[i];
+    if (i > 0 && (s = x->child[i - 1])->n >= WIDE_T) {
+        wide_shift(c, 0, 1);
+        if (!c->leaf) {
+            c->child[1] = c->child[0];
+            c->child[0] = s->child[s->n];
+        }
+        c->key[0] = x->key[i - 1];
+        c->value[0] = x->value[i - 1];
+        x->key[i - 1] = s->key[s->n - 1];
+        x->value[i - 1] = s->value[s->n - 1];
+        s->n--;
+    } else if (i < x->n && (s = x->child[i + 1])->n >= WIDE_T) {
+        c->key[c->n] = x->key[i];
+        c->value[c->n] = x->value[i];
+        if (!c->leaf)
+            c->child[c->n + 1] = s->child[0];
+        c->n++;
+        x->key[i] = s->key[0];
+        x->value[i] = s->value[0];
+        if (!s->leaf)
+            s->child[0] = s->child[1];
+        wide_shift(s, 1, -1);
+    } else if (i < x->n)
+        wide_merge(x, i);
+    else
+        wide_merge(x, --i);
+    return i;
+}
+
+/* Takes the largest (SIDE 1) or smallest key out of x, which holds at least
+   WIDE_T keys unless it is the root. */
+static void wide_take(x, side, key, value)
+avltree_wide *x;
+unsigned char side;
+void **key, **value;
+{
+    int i;
+
+    while (!x->leaf) {
+        i = side? x->n : 0;
+        if (x->child[i]->n < WIDE_T)
+            i = wide_fill(x, i);
+        x = x->child[i];
+    }
+    i = side? x->n - 1 : 0;
+    *key = x->key[i];
+    *value = x->value[i];
+    wide_shift(x, i + 1, -1);
+}
+
+static void wide_insert(t, key, value)
+avltree_tree *t;
+void *key, *value;
+{
+    avltree_wide *x, *s;
+    int i, cmp;
+
+    if (!t->wroot)
+        t->wroot = wide_node(1);
+    if (t->wroot->n == WIDE_MAX) {
+        s = wide_node(0);
+        s->child[0] = t->wroot;
+        wide_split(s, 0);
+        t->wroot = s;
+    }
+    AVL_STAT(t, lookups, 1);
+    for (x = t->wroot; ; x = x->child[i]) {
+        i = wide_search(t, x, key);
+        if (t->inplace && i < x->n && !AVL_COMPAR(t, key, x->key[i]))
+            break;
+        if (x->leaf) {
+            wide_shift(x, i, 1);
+            x->key[i] = key;
+            x->value[i] = value;
+            t->nmemb++;
+            return;
+        }
+        if (x->child[i]->n == WIDE_MAX) {
+            wide_split(x, i);
+            if (!(cmp = AVL_COMPAR(t, key, x->key[i])) && t->inplace)
+                break;
+            i += cmp > 0;
+        }
+    }
+    /* As insert_at(). */
+    free(x->value[i]);
+    x->value[i] = value;
+    free(key);
+}
+
+static wide_remove(t, key, flags)
+avltree_tree *t;
+void *key;
+unsigned char flags;
+{
+    avltree_wide *x;
+    int i;
+
+    if (!(x = t->wroot))
+        return 1;
+    /* Every node below the root is given WIDE_T keys before the descent
+       enters it, so one can always be taken out. */
+    AVL_STAT(t, lookups, 1);
+    for (;;) {
+        i = wide_search(t, x, key);
+        if (i < x->n && !AVL_COMPAR(t, key, x->key[i])) {
+            if (x->leaf || x->child[i]->n >= WIDE_T || x->child[i + 1]->n >= WIDE_T) {
+                if (flags & AVLTREE_FREE_KEY)
+                    free(x->key[i]);
+                if (flags & AVLTREE_FREE_VALUE)
+                    free(x->value[i]);
+                /* Replaced by its predecessor or successor. */
+                if (x->leaf)
+                    wide_shift(x, i + 1, -1);
+                else if (x->child[i]->n >= WIDE_T)
+                    wide_take(x->child[i], 1, &x->key[i], &x->value[i]);
+                else
+                    wide_take(x->child[i + 1], 0, &x->key[i], &x->value[i]);
+                break;
+            }
+            /* Both children are minimal: merge them around the key and
+               remove it from there. */
+            wide_merge(x, i);
+        } else if (x->leaf)
+            return 1;
+        else if (x->child[i]->n < WIDE_T)
+            i = wide_fill(x, i);
+        if (x == t->wroot && !x->n) {
+            t->wroot = x->child[0];
+            free(x);
+            x = t->wroot;
+        } else
+            x = x->child[i];
+    }
+    t->nmemb--;
+    if (!t->wroot->n) {
+        x = t->wroot;
+        t->wroot = x->leaf? NULL : x->child[0];
+        free(x);
+    }
+    return 0;
+}
+
+static void wide_free(x, flags)
+avltree_wide *x;
+unsigned char flags;
+{
+    int i;
+
+    for (i=0; i < x->n; i++) {
+        if (flags & AVLTREE_FREE_KEY)
+            free(x->key[i]);
+        if (flags & AVLTREE_FREE_VALUE)
+            free(x->value[i]);
+    }
+    if (!x->leaf)
+        for (i=0; i <= x->n; i++)
+            wide_free(x->child[i], flags);
+    free(x);
+}
+
+static void wide_destroy(t, flags)
+avltree_tree *t;
+unsigned char flags;
+{
+    if (t->wroot)
+        wide_free(t->wroot, flags);
+    t->wroot = NULL;
+    t->nmemb = 0;
+}
+
+void *avltree_lookup(t, key, valuep)
+avltree_tree *t;
+void *key, **valuep;
+{
+    avltree_node *n;
+    avltree_wide *x;
+    int i;
+
+    if (!t->wide) {
+        if (!(n = avl_find_node(t, t->root, key, NULL)))
+            return NULL;
+        if (valuep)
+            *valuep = AVL_VALUE(n);
+        return n->key;
+    }
+    AVL_STAT(t, lookups, 1);
+    for (x = t->wroot; x; x = x->child[i]) {
+        i = wide_search(t, x, key);
+        if (i < x->n && !AVL_COMPAR(t, key, x->key[i])) {
+            if (valuep)
+                *valuep = x->value[i];
+            return x->key[i];
+        }
+        if (x->leaf)
+            break;
+    }
+    return NULL;
+}
+
+/* Traversal with an explicit stack. The height of an AVL tree with n nodes
+   is below 1.45*log2(n+2), so the stack never grows past AVL_MAX_HEIGHT. */
+
+#define AVL_MAX_HEIGHT 64
+
+typedef struct {
+    avltree_node *stack[AVL_MAX_HEIGHT];
+    int top;
+} avl_walk;
+
+static void push_left(w, n)
+avl_walk *w;
+avltree_node *n;
+{
+    for (; n; n = n->child[0]) {
+        assert(w->top < AVL_MAX_HEIGHT);
+        w->stack[w->top++] = n;
+    }
+}
+
+/* Pushes the path to the first node in posfix order. */
+static void push_posfix(w, n)
+avl_walk *w;
+avltree_node *n;
+{
+    for (; n; n = n->child[n->child[0] == NULL]) {
+        assert(w->top < AVL_MAX_HEIGHT);
+        w->stack[w->top++] = n;
+    }
+}
+
+static void walk_infix(w, r)
+avl_walk *w;
+avltree_node *r;
+{
+    w->top = 0;
+    push_left(w, r);
+}
+
+static void walk_prefix(w, r)
+avl_walk *w;
+avltree_node *r;
+{
+    w->top = 0;
+    if (r)
+        w->stack[w->top++] = r;
+}
+
+static void walk_posfix(w, r)
+avl_walk *w;
+avltree_node *r;
+{
+    w->top = 0;
+    push_posfix(w, r);
+}
+
+static avltree_node *next_infix(w)
+avl_walk *w;
+{
+    avltree_node *n;
+
+    if (!w->top)
+        return NULL;
+    n = w->stack[--w->top];
+    push_left(w, n->child[1]);
+    return n;
+}
+
+static avltree_node *next_prefix(w)
+avl_walk *w;
+{
+    avltree_node *n;
+
+    if (!w->top)
+        return NULL;
+    n = w->stack[--w->top];
+    if (n->child[1])
+        w->stack[w->top++] = n->child[1];
+    if (n->child[0]) {
+        assert(w->top < AVL_MAX_HEIGHT);
+        w->stack[w->top++] = n->child[0];
+    }
+    return n;
+}
+
+/* The returned node is no longer referenced by the walk, so it can be freed. */
+static avltree_node *next_posfix(w)
+avl_walk *w;
+{
+    avltree_node *n, *p;
+
+    if (!w->top)
+        return NULL;
+    n = w->stack[--w->top];
+    if (w->top) {
+        p = w->stack[w->top-1];
+        if (p->child[0] == n)
+            push_posfix(w, p->child[1]);
+    }
+    return n;
+}
+
+/* Pool created by a tree for bulk loading. The trees split from it share it,
+   and meanwhile it cannot release nodes in bulk. */
+struct own_pool {
+    avltree_pool pool;
+    int refs;
+};
+
+/* Called once t has no nodes left in its own pool. */
+static void drop_pool(t)
+avltree_tree *t;
+{
+    struct own_pool *op;
+
+    op = (struct own_pool *)t->alloc;
+    if (!--op->refs) {
+        avltree_pool_destroy(&op->pool);
+        free(op);
+    } else if (op->refs == 1)
+        op->pool.allocator.release = pool_release;
+    t->alloc = NULL;
+    t->own_alloc = 0;
+}
+
+/* td starts using the allocator of ts. */
+static void share_alloc(td, ts)
+avltree_tree *td, *ts;
+{
+    td->alloc = ts->alloc;
+    td->own_alloc = ts->own_alloc;
+    if (ts->own_alloc) {
+        ((struct own_pool *)ts->alloc)->refs++;
+        ts->alloc->release = NULL;
+    }
+}
+
+/* Releases every node at once. */
+static void release_nodes(t)
+avltree_tree *t;
+{
+    AVL_STAT(t, frees, t->nmemb);
+    t->alloc->release(t->alloc->ctx);
+    if (t->own_alloc)
+        drop_pool(t);
+}
+
+/* Frees key and value as in avl_remove(); nodes only if NODES is true. */
+static void free_subtree(t, r, flags, nodes)
+avltree_tree *t;
+avltree_node *r;
+unsigned char flags, nodes;
+{
+    avltree_node *n;
+    avl_walk w;
+
+    walk_posfix(&w, r);
+    while ((n = next_posfix(&w))) {
+        if (flags & AVLTREE_FREE_KEY)
+            free(n->key);
+        if (flags & AVLTREE_FREE_VALUE && AVL_HAS_VALUE(n))
+            free(AVL_VALUE(n));
+        if (nodes)
+            free_node(t, n);
+    }
+}
 
 void avl_diff(td, ts, r, flags)
 avltree_tree *td, *ts;
 avltree_node *r;
 unsigned char flags;
 {
-    if (!r)
-        return;
-    avl_diff(td, ts, r->child[0], flags);
-    avl_diff(td, ts, r->child[1], flags);
-    avltree_remove_node_ptr(td, r->key, flags);
+    avltree_node *n;
+    avl_walk w;
+
+    walk_posfix(&w, r);
+    while ((n = next_posfix(&w)))
+        avltree_remove_node_ptr(td, n->key, flags);
+}
+
+void avl_empty(t, r)
+avltree_tree *t;
+avltree_node *r;
+{
+    if (t->wide)
+        wide_destroy(t, AVLTREE_FREE_NONE);
+    else if (r && r == t->root && AVL_BULK(t))
+        release_nodes(t);
+    else {
+        free_subtree(t, r, AVLTREE_FREE_NONE, 1);
+        if (r && r == t->root && t->own_alloc)
+            drop_pool(t);
+    }
+}
+
+void avl_copy_keys(td, ts, r)
+avltree_tree *td, *ts;
+avltree_node *r;
+{
+    avltree_node *n;
+    avl_walk w;
+
+    walk_posfix(&w, r);
+    while ((n = next_posfix(&w)))
+        avltree_insert(td, n->key, NULL);
+}
+
+void avl_destroy(t, r)
+avltree_tree *t;
+avltree_node *r;
+{
+    if (t->wide)
+        wide_destroy(t, AVLTREE_FREE_BOTH);
+    else if (r && r == t->root && AVL_BULK(t)) {
+        free_subtree(t, r, AVLTREE_FREE_BOTH, 0);
+        release_nodes(t);
+    } else {
+        free_subtree(t, r, AVLTREE_FREE_BOTH, 1);
+        if (r && r == t->root && t->own_alloc)
+            drop_pool(t);
+    }
+}
+
+avltree_node *avl_find_max(t, r)
+avltree_tree *t;
+avltree_node *r;
+{
+    if (r)
+        for (; r->child[1]; r = r->child[1]);
+    return r;
+}
+
+avltree_node *avl_find_min(t, r)
+avltree_tree *t;
+avltree_node *r;
+{
+    if (r)
+        for (; r->child[0]; r = r->child[0]);
+    return r;
+}
+
+avltree_node *avl_find_node(t, r, key, parent)
+avltree_tree *t;
+avltree_node *r, **parent;
+void *key;
+{
+    int cmp;
+    
+    AVL_STAT(t, lookups, 1);
+    for (; r; r = r->child[cmp > 0]) {
+        AVL_STAT(t, visited, 1);
+        if (!(cmp = AVL_COMPAR(t, key, r->key)))
+            return r;
+        if (parent)
+            *parent = r;
+    }
+    return NULL;
+}
+
+/* Augmented fields: */
+
+/* Recomputes the augmented fields of n from its children. */
+static void update(t, n)
+avltree_tree *t;
+avltree_node *n;
+{
+#ifdef AVLTREE_SIZE
+    n->size = AVL_SIZE(n->child[0]) + AVL_SIZE(n->child[1]) + AVL_COUNT(n);
+#endif
+#ifdef AVLTREE_AGG_TYPE
+    if (t->agg.combine)
+        n->agg = t->agg.combine(t->agg.combine(AVL_AGG(t, n->child[0]), t->agg.lift(n)),
+                                AVL_AGG(t, n->child[1]));
+#endif
+}
+
+/* Updates n and its ancestors, after n's subtree changed. */
+static void update_path(t, n)
+avltree_tree *t;
+avltree_node *n;
+{
+#ifdef AVL_AUGMENTED
+    for (; n; n = AVL_PARENT(n))
+        update(t, n);
+#endif
+}
+
+#ifdef AVLTREE_SIZE
+avltree_node *avl_select(t, k)
+avltree_tree *t;
+{
+    avltree_node *r;
+
+    for (r = t->root; r; ) {
+        if (k < AVL_SIZE(r->child[0]))
+            r = r->child[0];
+        else if (k < AVL_SIZE(r->child[0]) + AVL_COUNT(r))
+            return r;
+        else {
+            k -= AVL_SIZE(r->child[0]) + AVL_COUNT(r);
+            r = r->child[1];
+        }
+    }
+    return NULL;
+}
+
+avl_rank(t, key)
+avltree_tree *t;
+void *key;
+{
+    avltree_node *r;
+    int rank;
+
+    rank = 0;
+    for (r = t->root; r; )
+        if (AVL_COMPAR(t, key, r->key) <= 0)
+            r = r->child[0];
+        else {
+            rank += AVL_SIZE(r->child[0]) + AVL_COUNT(r);
+            r = r->child[1];
+        }
+    return rank;
+}
+
+avl_count_range(t, lo, hi)
+avltree_tree *t;
+void *lo, *hi;
+{
+    return (hi? avl_rank(t, hi) : AVL_SIZE(t->root)) - (lo? avl_rank(t, lo) : 0);
+}
+#endif
+
+#ifdef AVLTREE_AGG_TYPE
+void avltree_set_aggregate(t, lift, combine, identity)
+avltree_tree *t;
+AVLTREE_AGG_TYPE (*lift)(avltree_node *);
+AVLTREE_AGG_TYPE (*combine)(AVLTREE_AGG_TYPE, AVLTREE_AGG_TYPE);
+AVLTREE_AGG_TYPE identity;
+{
+    avltree_node *n;
+    avl_walk w;
+
+    t->agg.lift = lift;
+    t->agg.combine = combine;
+    t->agg.identity = identity;
+    walk_posfix(&w, t->root);
+    while ((n = next_posfix(&w)))
+        update(t, n);
+}
+
+void avl_update_node(t, n)
+avltree_tree *t;
+avltree_node *n;
+{
+    update_path(t, n);
+}
+
+/* The node where the paths to both bounds part is the first within them;
+   below it, the left path adds the right subtrees it passes within the
+   range, and the right path the left ones. */
+AVLTREE_AGG_TYPE avl_range_aggregate(t, lo, hi)
+avltree_tree *t;
+void *lo, *hi;
+{
+    avltree_node *r, *x;
+    AVLTREE_AGG_TYPE left, right;
+
+    for (r = t->root; r; )
+        if (lo && AVL_COMPAR(t, r->key, lo) < 0)
+            r = r->child[1];
+        else if (hi && AVL_COMPAR(t, r->key, hi) >= 0)
+            r = r->child[0];
+        else
+            break;
+    if (!r)
+        return t->agg.identity;
+    left = lo? t->agg.identity : AVL_AGG(t, r->child[0]);
+    for (x = lo? r->child[0] : NULL; x; )
+        if (AVL_COMPAR(t, x->key, lo) >= 0) {
+            left = t->agg.combine(t->agg.combine(t->agg.lift(x), AVL_AGG(t, x->child[1])), left);
+            x = x->child[0];
+        } else
+            x = x->child[1];
+    right = hi? t->agg.identity : AVL_AGG(t, r->child[1]);
+    for (x = hi? r->child[1] : NULL; x; )
+        if (AVL_COMPAR(t, x->key, hi) < 0) {
+            right = t->agg.combine(right, t->agg.combine(AVL_AGG(t, x->child[0]), t->agg.lift(x)));
+            x = x->child[1];
+        } else
+            x = x->child[0];
+    return t->agg.combine(t->agg.combine(left, t->agg.lift(r)), right);
+}
+#endif
+
+/* First node after KEY (side 1) or last node before it (side 0). Nodes equal
+   to KEY count unless STRICT. */
+static avltree_node *bound(t, r, key, side, strict)
+avltree_tree *t;
+avltree_node *r;
+void *key;
+unsigned char side, strict;
+{
+    avltree_node *best;
+    int cmp;
+
+    best = NULL;
+    AVL_STAT(t, lookups, 1);
+    while (r) {
+        AVL_STAT(t, visited, 1);
+        cmp = AVL_COMPAR(t, key, r->key);
+        if (cmp? (cmp < 0) == side : !strict) {
+            best = r;
+            r = r->child[!side];
+        } else
+            r = r->child[side];
+    }
+    return best;
+}
+
+avltree_node *avl_lower_bound(t, r, key)
+avltree_tree *t;
+avltree_node *r;
+void *key;
+{
+    return bound(t, r, key, 1, 0);
+}
+
+avltree_node *avl_upper_bound(t, r, key)
+avltree_tree *t;
+avltree_node *r;
+void *key;
+{
+    return bound(t, r, key, 1, 1);
+}
+
+avltree_node *avl_floor(t, r, key)
+avltree_tree *t;
+avltree_node *r;
+void *key;
+{
+    return bound(t, r, key, 0, 0);
+}
+
+avl_range(t, lo, hi, visit, ctx)
+avltree_tree *t;
+void *lo, *hi, *ctx;
+int (*visit)(void *, avltree_node *);
+{
+    avltree_node *n;
+    int ret;
+
+    n = lo? bound(t, t->root, lo, 1, 0) : avl_find_min(t, t->root);
+    for (; n && (!hi || AVL_COMPAR(t, n->key, hi) < 0); n = avl_next(n))
+        if ((ret = visit(ctx, n)))
+            return ret;
+    return 0;
+}
+
+/* Stores a link that avltree_mt readers may follow while it changes: a
+   release, so that they see the node it points to complete. */
+#define AVL_LINK(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+
+/* Least mirroed alg. */
+static void retrace(t, x, z, inc, removed)
+avltree_tree *t;
+avltree_node *x, *z;
+unsigned char removed;
+{
+    int orig_bf, bf_z0, bf_y0, depth;
+    unsigned char side_x;
+    avltree_node *y;
+
+    depth = 0;
+    while (x) {
+        depth++;
+        orig_bf = AVL_BF(x);
+        AVL_SET_BF(x, AVL_BF(x) + inc);
+        
+        /* Apply rotations. */
+        if (AVL_PARENT(x))
+            side_x = AVL_PARENT(x)->child[1] == x;
+        /* R */
+        if (AVL_BF(x)/2 > 0) {
+            bf_z0 = AVL_BF(z);
+            /* R */
+            if (bf_z0 >= 0) {
+                if (AVL_PARENT(x))
+                    AVL_LINK(AVL_PARENT(x)->child[side_x], z);
+                else
+                    AVL_LINK(t->root, z);
+                AVL_SET_PARENT(z, AVL_PARENT(x));
+                AVL_LINK(x->child[1], z->child[0]);
+                if (z->child[0])
+                    AVL_SET_PARENT(z->child[0], x);
+                AVL_LINK(z->child[0], x);
+                AVL_SET_PARENT(x, z);
+                
+                /* Update BFs. */
+                AVL_SET_BF(x, -bf_z0 + 1);
+                AVL_SET_BF(z, bf_z0 - 1);
+                update(t, x);
+                update(t, z);
+                AVL_ROTATED(t, 1);
+                /* New x: */
+                x = z;
+            /* L */
+            } else {
+                y = z->child[0];
+                if (AVL_PARENT(x))
+                    AVL_LINK(AVL_PARENT(x)->child[side_x], y);
+                else
+                    AVL_LINK(t->root, y);
+                AVL_SET_PARENT(y, AVL_PARENT(x));
+                AVL_LINK(x->child[1], y->child[0]);
+                if (y->child[0])
+                    AVL_SET_PARENT(y->child[0], x);
+                AVL_LINK(y->child[0], x);
+                AVL_SET_PARENT(x, y);
+                AVL_LINK(z->child[0], y->child[1]);
+                if (y->child[1])
+                    AVL_SET_PARENT(y->child[1], z);
+                AVL_LINK(y->child[1], z);
+                AVL_SET_PARENT(z, y);
+                
+                /* Update BFs. */
+                bf_y0 = AVL_BF(y);
+                if (bf_y0 < 0) {
+                    AVL_SET_BF(x, 0);
+                    AVL_SET_BF(z, 1);
+                } else {
+                    AVL_SET_BF(x, -bf_y0);    
+                    AVL_SET_BF(z, 0);
+                }
+                AVL_SET_BF(y, 0);
+                update(t, x);
+                update(t, z);
+                update(t, y);
+                AVL_ROTATED(t, 2);
+                /* New x: */
+                x = y;
+            }
+        /* L */
+        } else if (AVL_BF(x)/2 < 0) {
+            bf_z0 = AVL_BF(z);
+            /* R */
+            if (bf_z0 > 0) {
+                y = z->child[1];
+                if (AVL_PARENT(x))
+                    AVL_LINK(AVL_PARENT(x)->child[side_x], y);
+                else
+                    AVL_LINK(t->root, y);
+                AVL_SET_PARENT(y, AVL_PARENT(x));
+                AVL_LINK(x->child[0], y->child[1]);
+                if (y->child[1])
+                    AVL_SET_PARENT(y->child[1], x);
+                AVL_LINK(y->child[1], x);
+                AVL_SET_PARENT(x, y);
+                AVL_LINK(z->child[1], y->child[0]);
+                if (y->child[0])
+                    AVL_SET_PARENT(y->child[0], z);
+                AVL_LINK(y->child[0], z);
+                AVL_SET_PARENT(z, y);
+                
+                /* Update BFs. */
+                bf_y0 = AVL_BF(y);
+                if (bf_y0 > 0) {
+                    AVL_SET_BF(x, 0);
+                    AVL_SET_BF(z, -1);
+                } else {
+                    AVL_SET_BF(x, -bf_y0);    
+                    AVL_SET_BF(z, 0);
+                }
+                AVL_SET_BF(y, 0);
+                update(t, x);
+                update(t, z);
+                update(t, y);
+                AVL_ROTATED(t, 2);
+                /* New x: */
+                x = y;
+            /* L */
+            } else {
+                if (AVL_PARENT(x))
+                    AVL_LINK(AVL_PARENT(x)->child[side_x], z);
+                else
+                    AVL_LINK(t->root, z);
+                AVL_SET_PARENT(z, AVL_PARENT(x));
+                AVL_LINK(x->child[0], z->child[1]);
+                if (z->child[1])
+                    AVL_SET_PARENT(z->child[1], x);
+                AVL_LINK(z->child[1], x);
+                AVL_SET_PARENT(x, z);
+                
+                /* Update BFs. */
+                AVL_SET_BF(x, -bf_z0 - 1);
+                AVL_SET_BF(z, bf_z0 + 1);
+                update(t, x);
+                update(t, z);
+                AVL_ROTATED(t, 1);
+                /* New x: */
+                x = z;
+            }
+        }
+        /* If it balanced, it means that the increment or decrement was */
+        /* canceled out for the ancestors. */
+        if (!(removed ^ (AVL_BF(x) != 0)))
+            break;
+        inc = abs(AVL_BF(x) - orig_bf);
+        inc = removed ^ side_x? inc : -inc;
+        z = AVL_PARENT(x)? AVL_PARENT(x)->child[removed? AVL_BF(AVL_PARENT(x)) > 0: side_x] : x;
+        x = AVL_PARENT(x);
+    }
+#ifdef AVLTREE_STATS
+    t->stats.retraces++;
+    t->stats.retrace_steps += depth;
+    if (depth > t->stats.retrace_max)
+        t->stats.retrace_max = depth;
+#endif
+    AVL_PROBE2(retrace, t, depth);
+}
+
+/* Links a new leaf below parent, on SIDE, and rebalances. */
+void avl_link_node(t, parent, side, new)
+avltree_tree *t;
+avltree_node *parent, *new;
+unsigned char side;
+{
+    AVL_SET_PARENT(new, parent);
+    new->child[0] = new->child[1] = NULL;
+    AVL_SET_BF(new, 0);
+    AVL_SET_COUNT(new, 1);
+    update(t, new);
+    /* Linked once complete, for avltree_mt readers. */
+    if (parent)
+        AVL_LINK(parent->child[side], new);
+    else
+        AVL_LINK(t->root, new);
+    t->nmemb++;
+    update_path(t, parent);
+    if (parent)
+        retrace(t, parent, new, side * 2 - 1, 0);
+}
+
+/* Inserts below r, which must be the root or hold KEY strictly within the
+   bounds of its subtree. */
+static avltree_node *insert_at(t, r, key, value)
+avltree_tree *t;
+avltree_node *r;
+void *key, *value;
+{
+    avltree_node *node, *parent, *new;
+    int cmp, gt;
+    
+    /* Commom insert in bst, in a single descent. **** */
+    parent = NULL;
+    gt = 0;
+    AVL_STAT(t, lookups, 1);
+    for (node = r; node; node = node->child[gt]) {
+        AVL_STAT(t, visited, 1);
+        cmp = AVL_COMPAR(t, key, node->key);
+        if (!cmp && t->inplace) {
+            if (AVL_HAS_VALUE(node))
+                free(AVL_VALUE(node));
+            AVL_SET_VALUE(node, value);
+            AVL_VALUE_CHANGED(t, node);
+            free(key);
+#ifdef AVLTREE_COUNT
+            if (t->inplace == AVLTREE_MULTISET)
+                avl_add_count(t, node, 1, AVLTREE_FREE_NONE);
+#endif
+            return node;
+        }
+        parent = node;
+        /* Equal keys go to the left. */
+        gt = cmp > 0;
+    }
+    new = avl_alloc_node(t, sizeof(avltree_node));
+    new->key = key;
+    AVL_SET_VALUE(new, value);
+    /* **** */
+    avl_link_node(t, parent, gt, new);
+    return new;
+}
+
+avltree_node *avltree_insert(t, key, value)
+avltree_tree *t;
+void *key, *value;
+{
+    if (t->wide) {
+        wide_insert(t, key, value);
+        return NULL;
+    }
+    return insert_at(t, t->root, key, value);
+}
+
+avltree_node *avltree_upsert(t, probe, make_key, update_value, ctx)
+avltree_tree *t;
+void *probe, *ctx;
+void *(*make_key)(void *, void *, void **);
+void (*update_value)(void *, avltree_node *);
+{
+    avltree_node *node, *parent, *new;
+    void *key, *value;
+    int cmp, gt;
+
+    assert(!t->wide);
+    parent = NULL;
+    gt = 0;
+    AVL_STAT(t, lookups, 1);
+    for (node = t->root; node; node = node->child[gt]) {
+        AVL_STAT(t, visited, 1);
+        if (!(cmp = AVL_COMPAR(t, probe, node->key))) {
+            if (update_value) {
+                update_value(ctx, node);
+                AVL_VALUE_CHANGED(t, node);
+            }
+#ifdef AVLTREE_COUNT
+            if (t->inplace == AVLTREE_MULTISET)
+                avl_add_count(t, node, 1, AVLTREE_FREE_NONE);
+#endif
+            return node;
+        }
+        parent = node;
+        gt = cmp > 0;
+    }
+    value = NULL;
+    if (!(key = make_key(ctx, probe, &value)))
+        return NULL;
+    new = avl_alloc_node(t, sizeof(avltree_node));
+    new->key = key;
+    AVL_SET_VALUE(new, value);
+    avl_link_node(t, parent, gt, new);
+    return new;
+}
+
+/* Takes z out of the tree and rebalances it, without freeing z. */
+static void unlink_node(t, z)
+avltree_tree *t;
+avltree_node *z;
+{
+    avltree_node *y, *q, *parenty;
+    unsigned char side_z, two;
+    int inc;
+
+    q = AVL_PARENT(z);
+    two = 0;
+    if (z->child[0] && z->child[1]) {
+        y = avl_find_max(t, z->child[0]);
+        parenty = AVL_PARENT(y);
+        if (parenty != z) {
+            AVL_LINK(parenty->child[1], y->child[0]);
+            if (y->child[0])
+                AVL_SET_PARENT(y->child[0], parenty);
+            AVL_LINK(y->child[0], z->child[0]);
+            AVL_SET_PARENT(z->child[0], y);
+        }
+        AVL_LINK(y->child[1], z->child[1]);
+        AVL_SET_PARENT(z->child[1], y);
+        two = 1;
+        /* Update Y BF */
+        AVL_SET_BF(y, AVL_BF(z));
+    } else
+        y = z->child[0]? z->child[0] : z->child[1];
+    if (q) {
+        side_z = q->child[1] == z;
+        AVL_LINK(q->child[side_z], y);
+    } else
+        AVL_LINK(t->root, y);
+    if (y)
+        AVL_SET_PARENT(y, q);
+    update_path(t, two? (parenty == z? y : parenty) : q);
+
+    /* Update BFs */
+    if (y && two) {
+        if (parenty == z) {
+            parenty = y;
+            inc = 1;
+        } else
+            inc = -1;
+        retrace(t, parenty, parenty->child[AVL_BF(parenty) > 0], inc, 1);
+    } else if (q)
+        retrace(t, q, q->child[!(AVL_BF(q) || side_z) ||
+                AVL_BF(q) > 0],
+                side_z? -1 : 1, 1);
+}
+
+void avl_remove(t, z, flags)
+avltree_tree *t;
+avltree_node *z;
+unsigned char flags;
+{
+    assert(z);
+    unlink_node(t, z);
+    if (flags & AVLTREE_FREE_VALUE && AVL_HAS_VALUE(z))
+        free(AVL_VALUE(z));
+    if (flags & AVLTREE_FREE_KEY)
+        free(z->key);
+    free_node(t, z);
+    if (!--t->nmemb && t->own_alloc)
+        drop_pool(t);
+}
+
+avltree_remove(t, key, flags)
+avltree_tree *t;
+void *key;
+unsigned char flags;
+{
+    avltree_node *z;
+    
+    if (t->wide)
+        return wide_remove(t, key, flags);
+    if (!(z = avl_find_node(t, t->root, key, NULL)))
+        return 1;
+    avl_remove(t, z, flags);
+    return 0;
+}
+
+#ifdef AVLTREE_COUNT
+avltree_count(t, key)
+avltree_tree *t;
+void *key;
+{
+    avltree_node *n;
+
+    return (n = avl_find_node(t, t->root, key, NULL))? AVL_COUNT(n) : 0;
+}
+
+avl_add_count(t, n, delta, flags)
+avltree_tree *t;
+avltree_node *n;
+unsigned char flags;
+{
+    if (AVL_COUNT(n) + delta <= 0) {
+        avl_remove(t, n, flags);
+        return 0;
+    }
+    AVL_SET_COUNT(n, AVL_COUNT(n) + delta);
+    update_path(t, n);
+    return AVL_COUNT(n);
+}
+
+avltree_remove_one(t, key, flags)
+avltree_tree *t;
+void *key;
+unsigned char flags;
+{
+    avltree_node *z;
+
+    if (!(z = avl_find_node(t, t->root, key, NULL)))
+        return 1;
+    avl_add_count(t, z, -1, flags);
+    return 0;
+}
+#endif
+
+/* Cursors: */
+
+avltree_node *avl_next(n)
+avltree_node *n;
+{
+    if (n->child[1]) {
+        for (n = n->child[1]; n->child[0]; n = n->child[0]);
+        return n;
+    }
+    for (; AVL_PARENT(n) && AVL_PARENT(n)->child[1] == n; n = AVL_PARENT(n));
+    return AVL_PARENT(n);
+}
+
+avltree_node *avl_prev(n)
+avltree_node *n;
+{
+    if (n->child[0]) {
+        for (n = n->child[0]; n->child[1]; n = n->child[1]);
+        return n;
+    }
+    for (; AVL_PARENT(n) && AVL_PARENT(n)->child[0] == n; n = AVL_PARENT(n));
+    return AVL_PARENT(n);
+}
+
+avltree_node *avltree_cursor_first(c, t)
+avltree_cursor *c;
+avltree_tree *t;
+{
+    c->t = t;
+    return c->node = avl_find_min(t, t->root);
+}
+
+avltree_node *avltree_cursor_last(c, t)
+avltree_cursor *c;
+avltree_tree *t;
+{
+    c->t = t;
+    return c->node = avl_find_max(t, t->root);
+}
+
+avltree_node *avltree_cursor_seek(c, t, key)
+avltree_cursor *c;
+avltree_tree *t;
+void *key;
+{
+    c->t = t;
+    return c->node = avl_lower_bound(t, t->root, key);
+}
+
+avltree_node *avltree_cursor_next(c)
+avltree_cursor *c;
+{
+    if (c->node)
+        c->node = avl_next(c->node);
+    return c->node;
+}
+
+avltree_node *avltree_cursor_prev(c)
+avltree_cursor *c;
+{
+    if (c->node)
+        c->node = avl_prev(c->node);
+    return c->node;
+}
+
+/* avl_remove() relinks the nodes instead of moving keys between them, so the
+   next node stays valid. */
+avltree_node *avltree_cursor_remove(c, flags)
+avltree_cursor *c;
+unsigned char flags;
+{
+    avltree_node *z;
+
+    if (!(z = c->node))
+        return NULL;
+    c->node = avl_next(z);
+    avl_remove(c->t, z, flags);
+    return c->node;
+}
+
+/* Bulk loading: */
+
+/* Links the first N nodes of the list threaded through child[1] into a
+   balanced subtree, consuming them from *HEAD. */
+static avltree_node *build_list(t, head, n, parent, height)
+avltree_tree *t;
+avltree_node **head, *parent;
+int *height;
+{
+    avltree_node *r, *left;
+    int lh, rh;
+
+    if (!n) {
+        *height = 0;
+        return NULL;
+    }
+    left = build_list(t, head, (n-1)/2, NULL, &lh);
+    r = *head;
+    *head = r->child[1];
+    AVL_SET_PARENT(r, parent);
+    r->child[0] = left;
+    if (left)
+        AVL_SET_PARENT(left, r);
+    r->child[1] = build_list(t, head, n - 1 - (n-1)/2, r, &rh);
+    AVL_SET_BF(r, rh - lh);
+    update(t, r);
+    *height = (rh > lh? rh : lh) + 1;
+    return r;
+}
+
+/* Gives t a private pool with room for n nodes in a single block. */
+static own_pool_init(t, n)
+avltree_tree *t;
+{
+    struct own_pool *p;
+
+    if (!(p = malloc(sizeof(struct own_pool))))
+        return 1;
+    avltree_pool_init(&p->pool, sizeof(avltree_node), 0, 0);
+    avltree_pool_reserve(&p->pool, n);
+    p->refs = 1;
+    t->alloc = &p->pool.allocator;
+    t->own_alloc = 1;
+    return 0;
+}
+
+avltree_build_sorted(t, keys, values, n, stride)
+avltree_tree *t;
+void *keys, **values;
+size_t stride;
+{
+    avltree_node *head, **tail, *r;
+    int i, h;
+
+    if (t->root)
+        return 1;
+    if (!n)
+        return 0;
+    if (!t->alloc && own_pool_init(t, n))
+        return 1;
+    for (i=0, tail = &head; i < n; i++, tail = &r->child[1]) {
+        *tail = r = avl_alloc_node(t, sizeof(avltree_node));
+        r->key = stride? (unsigned char *)keys + i*stride : ((void **)keys)[i];
+        AVL_SET_VALUE(r, values? values[i] : NULL);
+        AVL_SET_COUNT(r, 1);
+    }
+    *tail = NULL;
+    t->root = build_list(t, &head, n, NULL, &h);
+    t->nmemb = n;
+    return 0;
+}
+
+/* Batches: */
+
+struct avl_kv {
+    void *key, *value;
+};
+
+/* Stable bottom-up merge sort, O(n) on sorted input. Returns a or b,
+   whichever holds the result. */
+static struct avl_kv *sort_kv(t, a, b, n)
+avltree_tree *t;
+struct avl_kv *a, *b;
+int n;
+{
+    struct avl_kv *tmp;
+    int w, i, l, m, r, k;
+
+    for (w = 1; w < n; w *= 2) {
+        for (i=0; i < n; i += 2*w) {
+            m = i + w < n? i + w : n;
+            r = i + 2*w < n? i + 2*w : n;
+            if (m == r || AVL_COMPAR(t, a[m-1].key, a[m].key) <= 0) {
+                memcpy(b + i, a + i, sizeof(struct avl_kv) * (r - i));
+                continue;
+            }
+            for (l = i, k = i, tmp = a + m; k < r; k++)
+                if (l < m && (tmp == a + r || AVL_COMPAR(t, tmp->key, a[l].key) >= 0))
+                    b[k] = a[l++];
+                else
+                    b[k] = *tmp++;
+        }
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+    return a;
+}
+
+/* Finger search: climbs from x to the lowest ancestor whose subtree holds
+   KEY strictly within its bounds, so that a descent from there ends where
+   one from the root would. */
+static avltree_node *climb(t, x, key)
+avltree_tree *t;
+avltree_node *x;
+void *key;
+{
+    avltree_node *y, *p;
+    unsigned char need[2], side;
+    int cmp;
+
+    if (!x)
+        return t->root;
+    /* Lower and upper bounds of the subtree of x still to check. */
+    need[0] = need[1] = 1;
+    for (y = x; (p = AVL_PARENT(y)) && (need[0] || need[1]); y = p) {
+        side = p->child[1] == y;
+        if (!need[!side])
+            continue;
+        need[!side] = 0;
+        cmp = AVL_COMPAR(t, key, p->key);
+        if (side? cmp <= 0 : cmp >= 0) {
+            x = p;
+            need[0] = need[1] = 1;
+        }
+    }
+    return x;
+}
+
+/* Bulk loads the sorted batch s into an empty tree, with equal keys in the
+   order successive insertions would leave them. buf holds n entries. */
+static build_batch(t, s, buf, n)
+avltree_tree *t;
+struct avl_kv *s, *buf;
+{
+    void **keys, **values;
+    int i, j, m;
+
+    keys = (void **)buf;
+    values = keys + n;
+    for (i=0; i < n; i = j) {
+        for (j = i + 1; j < n && !AVL_COMPAR(t, s[i].key, s[j].key); j++)
+            ;
+        if (j - i > 1 && t->inplace)
+            return 1;
+        for (m = i; m < j; m++) {
+            keys[m] = s[i + j - 1 - m].key;
+            values[m] = s[i + j - 1 - m].value;
+        }
+    }
+    return avltree_build_sorted(t, keys, values, n, 0);
+}
+
+void avltree_insert_batch(t, keys, values, n)
+avltree_tree *t;
+void **keys, **values;
+{
+    struct avl_kv *mem, *s;
+    avltree_node *x;
+    int i;
+
+    assert(!t->wide);
+    if (n <= 0)
+        return;
+    if (!(mem = malloc(sizeof(struct avl_kv) * 2 * n))) {
+        for (i=0; i < n; i++)
+            avltree_insert(t, keys[i], values? values[i] : NULL);
+        return;
+    }
+    for (i=0; i < n; i++) {
+        mem[i].key = keys[i];
+        mem[i].value = values? values[i] : NULL;
+    }
+    s = sort_kv(t, mem, mem + n, n);
+    if (t->root || build_batch(t, s, s == mem? mem + n : mem, n))
+        for (x = NULL, i=0; i < n; i++)
+            x = insert_at(t, climb(t, x, s[i].key), s[i].key, s[i].value);
+    free(mem);
+}
+
+avltree_remove_batch(t, keys, n, flags)
+avltree_tree *t;
+void **keys;
+unsigned char flags;
+{
+    struct avl_kv *mem, *s;
+    avltree_node *x, *z;
+    int i, removed;
+
+    assert(!t->wide);
+    if (n <= 0)
+        return 0;
+    removed = 0;
+    if (!(mem = malloc(sizeof(struct avl_kv) * 2 * n))) {
+        for (i=0; i < n; i++)
+            removed += !avltree_remove(t, keys[i], flags);
+        return removed;
+    }
+    for (i=0; i < n; i++) {
+        mem[i].key = keys[i];
+        mem[i].value = NULL;
+    }
+    s = sort_kv(t, mem, mem + n, n);
+    for (x = NULL, i=0; i < n; i++) {
+        x = climb(t, x, s[i].key);
+        if (!(z = avl_find_node(t, x, s[i].key, NULL)))
+            continue;
+        /* The finger must survive z. */
+        if (!(x = avl_next(z)))
+            x = avl_prev(z);
+        avl_remove(t, z, flags);
+        removed++;
+    }
+    free(mem);
+    return removed;
+}
+
+/* Set algebra: */
+
+static void drop_node(t, n, flags)
+avltree_tree *t;
+avltree_node *n;
+unsigned char flags;
+{
+    if (flags & AVLTREE_FREE_KEY)
+        free(n->key);
+    if (flags & AVLTREE_FREE_VALUE && AVL_HAS_VALUE(n))
+        free(AVL_VALUE(n));
+    free_node(t, n);
+}
+
+/* A node of ts that enters td. */
+static avltree_node *take_node(td, ts, n, move)
+avltree_tree *td, *ts;
+avltree_node *n;
+unsigned char move;
+{
+    avltree_node *new;
+
+    if (move && td->alloc == ts->alloc)
+        return n;
+    new = avl_alloc_node(td, sizeof(avltree_node));
+    new->key = n->key;
+    AVL_SET_VALUE(new, move? AVL_VALUE(n) : NULL);
+    AVL_SET_COUNT(new, AVL_COUNT(n));
+    if (move)
+        free_node(ts, n);
+    return new;
+}
+
+/* td becomes td OP ts by merging both in order and rebuilding it, in
+   O(m + n). The nodes of td left out are freed with FLAGS. If MOVE, ts ends
+   empty: its nodes go to td or are freed with FLAGS. Otherwise ts is kept
+   and td gets its keys, as in avl_copy_keys(). */
+void avl_set_op(td, ts, op, move, flags)
+avltree_tree *td, *ts;
+unsigned char op, move, flags;
+{
+    avltree_node *a, *b, *next, *head, **tail;
+    avl_walk wa, wb;
+    int cmp, n, h;
+
+    walk_infix(&wa, td->root);
+    walk_infix(&wb, ts->root);
+    a = next_infix(&wa);
+    b = next_infix(&wb);
+    tail = &head;
+    n = 0;
+    while (a || b) {
+        cmp = !a? 1 : !b? -1 : AVL_COMPAR(td, a->key, b->key);
+        if (cmp <= 0) {
+            next = next_infix(&wa);
+            if (op & (cmp? AVLTREE_SET_TD : AVLTREE_SET_BOTH)) {
+                *tail = a;
+                tail = &a->child[1];
+                n++;
+            } else
+                drop_node(td, a, flags);
+            a = next;
+        }
+        if (cmp >= 0) {
+            next = next_infix(&wb);
+            if (!cmp || !(op & AVLTREE_SET_TS)) {
+                if (move)
+                    drop_node(ts, b, flags);
+            } else {
+                *tail = take_node(td, ts, b, move);
+                tail = &(*tail)->child[1];
+                n++;
+            }
+            b = next;
+        }
+    }
+    *tail = NULL;
+    td->root = build_list(td, &head, n, NULL, &h);
+    td->nmemb = n;
+    if (!n && td->own_alloc)
+        drop_pool(td);
+    if (move) {
+        ts->root = NULL;
+        ts->nmemb = 0;
+        if (ts->own_alloc)
+            drop_pool(ts);
+    }
+}
+
+/* Split and join: */
+
+/* O(log n), following the taller child. */
+static int subtree_height(r)
+avltree_node *r;
+{
+    int h;
+
+    for (h = 0; r; h++)
+        r = r->child[AVL_BF(r) > 0];
+    return h;
+}
+
+/* Raises the child of x on SIDE. The BFs are updated from the heights they
+   imply, so x does not need to be balanced. Returns the new subtree root. */
+static avltree_node *rotate(t, x, side)
+avltree_tree *t;
+avltree_node *x;
+unsigned char side;
+{
+    avltree_node *z;
+    int bf_x, bf_z;
+
+    z = x->child[side];
+    if (AVL_PARENT(x))
+        AVL_PARENT(x)->child[AVL_PARENT(x)->child[1] == x] = z;
+    AVL_SET_PARENT(z, AVL_PARENT(x));
+    x->child[side] = z->child[!side];
+    if (z->child[!side])
+        AVL_SET_PARENT(z->child[!side], x);
+    z->child[!side] = x;
+    AVL_SET_PARENT(x, z);
+
+    bf_x = AVL_BF(x);
+    bf_z = AVL_BF(z);
+    if (side) {
+        AVL_SET_BF(x, bf_x - 1 - (bf_z > 0? bf_z : 0));
+        AVL_SET_BF(z, bf_z - 1 + (AVL_BF(x) < 0? AVL_BF(x) : 0));
+    } else {
+        AVL_SET_BF(x, bf_x + 1 - (bf_z < 0? bf_z : 0));
+        AVL_SET_BF(z, bf_z + 1 + (AVL_BF(x) > 0? AVL_BF(x) : 0));
+    }
+    update(t, x);
+    update(t, z);
+    return z;
+}
+
+/* Fixes a BF of +-2 at x with a single or double rotation. */
+static avltree_node *rebalance(t, x)
+avltree_tree *t;
+avltree_node *x;
+{
+    unsigned char side;
+
+    side = AVL_BF(x) > 0;
+    if (AVL_BF(x->child[side]) == (side? -1 : 1)) {
+        rotate(t, x->child[side], !side);
+        AVL_ROTATED(t, 2);
+    } else
+        AVL_ROTATED(t, 1);
+    return rotate(t, x, side);
+}
+
+/* Joins the detached subtrees l < k < r of heights lh and rh in
+   O(|lh - rh| + 1). Returns the new root and stores its height in h. */
+static avltree_node *join(t, l, lh, k, r, rh, h)
+avltree_tree *t;
+avltree_node *l, *k, *r;
+int lh, rh, *h;
+{
+    avltree_node *c, *p, *x, *grown;
+    unsigned char dir;
+    int ch, sh, bf_grown;
+
+    if (l)
+        AVL_SET_PARENT(l, NULL);
+    if (r)
+        AVL_SET_PARENT(r, NULL);
+    if (abs(lh - rh) <= 1) {
+        AVL_SET_PARENT(k, NULL);
+        k->child[0] = l;
+        k->child[1] = r;
+        if (l)
+            AVL_SET_PARENT(l, k);
+        if (r)
+            AVL_SET_PARENT(r, k);
+        AVL_SET_BF(k, rh - lh);
+        update(t, k);
+        *h = (lh > rh? lh : rh) + 1;
+        return k;
+    }
+    /* Descend the taller tree towards the shorter one. */
+    dir = lh > rh;
+    c = dir? l : r;
+    ch = *h = dir? lh : rh;
+    sh = dir? rh : lh;
+    for (p = NULL; ch > sh + 1; c = c->child[dir]) {
+        ch -= AVL_BF(c) == (dir? -1 : 1)? 2 : 1;
+        p = c;
+    }
+    k->child[!dir] = c;
+    k->child[dir] = dir? r : l;
+    if (c)
+        AVL_SET_PARENT(c, k);
+    if (k->child[dir])
+        AVL_SET_PARENT(k->child[dir], k);
+    AVL_SET_BF(k, dir? sh - ch : ch - sh);
+    update(t, k);
+    AVL_SET_PARENT(k, p);
+    p->child[dir] = k;
+
+    /* The subtree at k is one level taller than c was. */
+    for (x = p, grown = k; x; grown = x, x = AVL_PARENT(x)) {
+        AVL_SET_BF(x, AVL_BF(x) + (x->child[1] == grown? 1 : -1));
+        update(t, x);
+        if (!AVL_BF(x))
+            break;
+        if (abs(AVL_BF(x)) == 1)
+            continue;
+        bf_grown = AVL_BF(grown);
+        x = rebalance(t, x);
+        if (bf_grown)
+            break;
+    }
+    if (x)
+        update_path(t, AVL_PARENT(x));
+    else
+        ++*h;
+    for (x = k; AVL_PARENT(x); x = AVL_PARENT(x));
+    return x;
+}
+
+/* Splits the subtree r into the keys less than KEY and the others. */
+static void split(t, r, key, l, lh, g, gh)
+avltree_tree *t;
+avltree_node *r, **l, **g;
+void *key;
+int *lh, *gh;
+{
+    avltree_node *path[AVL_MAX_HEIGHT], *c;
+    int height[AVL_MAX_HEIGHT], n, h, ch;
+    unsigned char dir[AVL_MAX_HEIGHT];
+
+    h = subtree_height(r);
+    for (n = 0; r; n++) {
+        assert(n < AVL_MAX_HEIGHT);
+        path[n] = r;
+        height[n] = h;
+        dir[n] = AVL_COMPAR(t, key, r->key) > 0;
+        h -= AVL_BF(r) == (dir[n]? -1 : 1)? 2 : 1;
+        r = r->child[dir[n]];
+    }
+    *l = *g = NULL;
+    *lh = *gh = 0;
+    while (n--) {
+        r = path[n];
+        /* The child not followed. */
+        c = r->child[!dir[n]];
+        ch = height[n] - (AVL_BF(r) == (dir[n]? 1 : -1)? 2 : 1);
+        if (dir[n])
+            *l = join(t, c, ch, r, *l, *lh, lh);
+        else
+            *g = join(t, *g, *gh, r, c, ch, gh);
+    }
+}
+
+/* Joins l and r without a pivot, using the minimum of r. */
+static avltree_node *concat(t, l, lh, r, rh, h)
+avltree_tree *t;
+avltree_node *l, *r;
+int lh, rh, *h;
+{
+    avltree_tree tmp;
+    avltree_node *k;
+
+    if (!l || !r) {
+        *h = l? lh : rh;
+        return l? l : r;
+    }
+    tmp = *t;
+    tmp.root = r;
+    AVL_SET_PARENT(r, NULL);
+    k = avl_find_min(&tmp, r);
+    unlink_node(&tmp, k);
+    return join(t, l, lh, k, tmp.root, subtree_height(tmp.root), h);
+}
+
+/* Makes td use the allocator of ts, copying its nodes in O(n) if needed. */
+static void adopt_nodes(td, ts)
+avltree_tree *td, *ts;
+{
+    avltree_node *n, *head, **tail;
+    avl_walk w;
+    int h;
+
+    if (td->alloc == ts->alloc)
+        return;
+    walk_infix(&w, ts->root);
+    for (tail = &head; (n = next_infix(&w)); tail = &(*tail)->child[1])
+        *tail = take_node(td, ts, n, 1);
+    *tail = NULL;
+    ts->root = build_list(td, &head, ts->nmemb, NULL, &h);
+    if (ts->own_alloc)
+        drop_pool(ts);
+}
+
+static count_nodes(r)
+avltree_node *r;
+{
+#if defined(AVLTREE_SIZE) && !defined(AVLTREE_COUNT)
+    return AVL_SIZE(r);
+#else
+    avl_walk w;
+    int n;
+
+    walk_infix(&w, r);
+    for (n = 0; next_infix(&w); n++);
+    return n;
+#endif
+}
+
+void avltree_split(t, key, left, right)
+avltree_tree *t, *left, *right;
+void *key;
+{
+    avl_split(t, key, left, right, -1);
+}
+
+void avl_split(t, key, left, right, nleft)
+avltree_tree *t, *left, *right;
+void *key;
+{
+    avltree_node *l, *g;
+    avltree_tree orig;
+    int lh, gh;
+
+    /* Both halves keep the allocator. */
+    assert(!AVL_BULK(t) || t->own_alloc);
+    split(t, t->root, key, &l, &lh, &g, &gh);
+    orig = *t;
+    *left = orig;
+    left->root = l;
+    left->nmemb = nleft < 0? count_nodes(l) : nleft;
+    *right = orig;
+    share_alloc(right, &orig);
+    right->root = g;
+    right->nmemb = orig.nmemb - left->nmemb;
+    if (t != left && t != right) {
+        t->root = NULL;
+        t->nmemb = 0;
+        t->alloc = NULL;
+        t->own_alloc = 0;
+    }
+    if (!left->nmemb && left->own_alloc)
+        drop_pool(left);
+    if (!right->nmemb && right->own_alloc)
+        drop_pool(right);
+}
+
+void avltree_join(left, key, value, right)
+avltree_tree *left, *right;
+void *key, *value;
+{
+    avltree_node *k;
+    int h;
+
+    adopt_nodes(left, right);
+    if (key) {
+        assert(!left->root || AVL_COMPAR(left, avl_find_max(left, left->root)->key, key) < 0);
+        assert(!right->root || AVL_COMPAR(left, key, avl_find_min(right, right->root)->key) < 0);
+        k = avl_alloc_node(left, sizeof(avltree_node));
+        k->key = key;
+        AVL_SET_VALUE(k, value);
+        AVL_SET_COUNT(k, 1);
+        left->root = join(left, left->root, subtree_height(left->root), k,
+                          right->root, subtree_height(right->root), &h);
+        left->nmemb++;
+    } else
+        left->root = concat(left, left->root, subtree_height(left->root),
+                            right->root, subtree_height(right->root), &h);
+    left->nmemb += right->nmemb;
+    right->root = NULL;
+    right->nmemb = 0;
+    if (right->own_alloc)
+        drop_pool(right);
+}
+
+/* Parallel bulk operations: */
+
+/* Subtrees up to this height, or ranges up to this many keys, are left to
+   a single thread. */
+#define AVL_PAR_HEIGHT 12
+#define AVL_PAR_NODES 4096
+
+/* Runs fn(a) and fn(b), in parallel if BIG. */
+static void fork2(ex, big, fn, a, b)
+avltree_exec *ex;
+unsigned char big;
+void (*fn)(void *);
+void *a, *b;
+{
+    void *h;
+
+    if (ex && big) {
+        h = ex->spawn(ex->ctx, fn, a);
+        fn(b);
+        ex->sync(ex->ctx, h);
+    } else {
+        fn(a);
+        fn(b);
+    }
+}
+
+#ifdef AVLTREE_STATS
+/* Tasks that may run in parallel count into copies a and b of t, added
+   back once both are done, so that no two threads share counters. */
+static void stats_fork(t, a, b)
+avltree_tree *t, *a, *b;
+{
+    *a = *b = *t;
+    avltree_stats_reset(a);
+    avltree_stats_reset(b);
+}
+
+static void stats_add(d, s)
+avltree_stats *d, *s;
+{
+    d->compar += s->compar;
+    d->lookups += s->lookups;
+    d->visited += s->visited;
+    d->single_rotations += s->single_rotations;
+    d->double_rotations += s->double_rotations;
+    d->retraces += s->retraces;
+    d->retrace_steps += s->retrace_steps;
+    if (s->retrace_max > d->retrace_max)
+        d->retrace_max = s->retrace_max;
+    d->allocs += s->allocs;
+    d->frees += s->frees;
+}
+
+static void stats_join(t, a, b)
+avltree_tree *t, *a, *b;
+{
+    stats_add(&t->stats, &a->stats);
+    stats_add(&t->stats, &b->stats);
+}
+#endif
+
+struct par_build {
+    avltree_exec *ex;
+    avltree_tree *t;
+    avltree_node **nodes;
+    void *keys, **values;
+    size_t stride;
+    int lo, hi;
+    avltree_node *root;
+    int h;
+};
+
+static void build_task(arg)
+void *arg;
+{
+    struct par_build *b, l, r;
+    avltree_node *n;
+    int mid;
+
+    b = arg;
+    if (b->lo >= b->hi) {
+        b->root = NULL;
+        b->h = 0;
+        return;
+    }
+    mid = b->lo + (b->hi - b->lo) / 2;
+    l = r = *b;
+    l.hi = mid;
+    r.lo = mid + 1;
+    fork2(b->ex, b->hi - b->lo > AVL_PAR_NODES, build_task, &l, &r);
+    n = b->nodes[mid];
+    n->key = b->stride? (unsigned char *)b->keys + mid * b->stride : ((void **)b->keys)[mid];
+    AVL_SET_VALUE(n, b->values? b->values[mid] : NULL);
+    AVL_SET_COUNT(n, 1);
+    AVL_SET_PARENT(n, NULL);
+    AVL_SET_BF(n, r.h - l.h);
+    n->child[0] = l.root;
+    n->child[1] = r.root;
+    if (l.root)
+        AVL_SET_PARENT(l.root, n);
+    if (r.root)
+        AVL_SET_PARENT(r.root, n);
+    update(b->t, n);
+    b->root = n;
+    b->h = (l.h > r.h? l.h : r.h) + 1;
+}
+
+avltree_par_build(ex, t, keys, values, n, stride)
+avltree_exec *ex;
+avltree_tree *t;
+void *keys, **values;
+size_t stride;
+{
+    struct par_build b;
+    int i;
+
+    if (t->root)
+        return 1;
+    if (!n)
+        return 0;
+    if (!(b.nodes = malloc(sizeof(avltree_node *) * n)))
+        return 1;
+    if (!t->alloc && own_pool_init(t, n)) {
+        free(b.nodes);
+        return 1;
+    }
+    /* The allocator need not be thread safe. */
+    for (i=0; i < n; i++)
+        b.nodes[i] = avl_alloc_node(t, sizeof(avltree_node));
+    b.ex = ex;
+    b.t = t;
+    b.keys = keys;
+    b.values = values;
+    b.stride = stride;
+    b.lo = 0;
+    b.hi = n;
+    build_task(&b);
+    free(b.nodes);
+    t->root = b.root;
+    t->nmemb = n;
+    return 0;
+}
+
+/* Removes the minimum of r, of height rh, into m. */
+static avltree_node *take_min(t, r, rh, m, h)
+avltree_tree *t;
+avltree_node *r, **m;
+int rh, *h;
+{
+    avltree_node *l;
+    int lh;
+
+    if (!r->child[0]) {
+        *m = r;
+        *h = rh - 1;
+        l = r->child[1];
+        r->child[1] = NULL;
+        if (l)
+            AVL_SET_PARENT(l, NULL);
+        return l;
+    }
+    l = take_min(t, r->child[0], rh - (AVL_BF(r) > 0? 2 : 1), m, &lh);
+    return join(t, l, lh, r, r->child[1], rh - (AVL_BF(r) < 0? 2 : 1), h);
+}
+
+/* td = td OP ts on the subtrees a of td and b of ts. Subtrees to free are
+   linked through their parent pointers, from drop to tail. */
+struct par_set {
+    avltree_exec *ex;
+    avltree_tree *t;
+    unsigned char op;
+    avltree_node *a, *b;
+    int ah, bh;
+    avltree_node *root, *drop, *tail;
+    int h;
+};
+
+static void drop_subtree(s, r)
+struct par_set *s;
+avltree_node *r;
+{
+    /* Its children may have been cut, and count_nodes() reads sizes. */
+    update(s->t, r);
+    AVL_SET_PARENT(r, s->drop);
+    s->drop = r;
+    if (!s->tail)
+        s->tail = r;
+}
+
+static void append_drops(s, o)
+struct par_set *s, *o;
+{
+    if (!o->drop)
+        return;
+    if (s->tail)
+        AVL_SET_PARENT(s->tail, o->drop);
+    else
+        s->drop = o->drop;
+    s->tail = o->tail;
+}
+
+/* Splits b by the root k of a, then works on both sides in parallel and
+   joins them back through k, as in Blelloch et al., "Just Join for
+   Parallel Ordered Sets". */
+static void set_task(arg)
+void *arg;
+{
+    struct par_set *s, l, r;
+    avltree_node *k, *eq, *bl, *bg;
+    int blh, bgh;
+#ifdef AVLTREE_STATS
+    avltree_tree lt, rt;
+#endif
+
+    s = arg;
+    s->drop = s->tail = NULL;
+    if (!s->a || !s->b) {
+        k = s->a? s->a : s->b;
+        s->root = NULL;
+        s->h = 0;
+        if (k && s->op & (s->a? AVLTREE_SET_TD : AVLTREE_SET_TS)) {
+            s->root = k;
+            s->h = s->a? s->ah : s->bh;
+        } else if (k)
+            drop_subtree(s, k);
+        return;
+    }
+    k = s->a;
+    split(s->t, s->b, k->key, &bl, &blh, &bg, &bgh);
+    eq = NULL;
+    if (bg && !AVL_COMPAR(s->t, avl_find_min(s->t, bg)->key, k->key))
+        bg = take_min(s->t, bg, bgh, &eq, &bgh);
+    l = r = *s;
+    l.a = k->child[0];
+    l.ah = s->ah - (AVL_BF(k) > 0? 2 : 1);
+    l.b = bl;
+    l.bh = blh;
+    r.a = k->child[1];
+    r.ah = s->ah - (AVL_BF(k) < 0? 2 : 1);
+    r.b = bg;
+    r.bh = bgh;
+#ifdef AVLTREE_STATS
+    if (s->ex && s->ah > AVL_PAR_HEIGHT) {
+        stats_fork(s->t, &lt, &rt);
+        l.t = &lt;
+        r.t = &rt;
+    }
+#endif
+    fork2(s->ex, s->ah > AVL_PAR_HEIGHT, set_task, &l, &r);
+#ifdef AVLTREE_STATS
+    if (s->ex && s->ah > AVL_PAR_HEIGHT)
+        stats_join(s->t, &lt, &rt);
+#endif
+    if (s->op & (eq? AVLTREE_SET_BOTH : AVLTREE_SET_TD))
+        s->root = join(s->t, l.root, l.h, k, r.root, r.h, &s->h);
+    else {
+        k->child[0] = k->child[1] = NULL;
+        drop_subtree(s, k);
+        s->root = concat(s->t, l.root, l.h, r.root, r.h, &s->h);
+    }
+    if (eq)
+        drop_subtree(s, eq);
+    append_drops(s, &l);
+    append_drops(s, &r);
+}
+
+void avltree_par_set_op(ex, td, ts, op, flags)
+avltree_exec *ex;
+avltree_tree *td, *ts;
+unsigned char op, flags;
+{
+    struct par_set s;
+    avltree_node *n, *next;
+    int dropped;
+
+    adopt_nodes(td, ts);
+    s.ex = ex;
+    s.t = td;
+    s.op = op;
+    s.a = td->root;
+    s.ah = subtree_height(td->root);
+    s.b = ts->root;
+    s.bh = subtree_height(ts->root);
+    set_task(&s);
+    if (s.root)
+        AVL_SET_PARENT(s.root, NULL);
+    /* Dropped nodes are freed by this thread, through the allocator. */
+    for (dropped = 0, n = s.drop; n; n = next) {
+        next = AVL_PARENT(n);
+        dropped += count_nodes(n);
+        free_subtree(td, n, flags, 1);
+    }
+    td->root = s.root;
+    td->nmemb += ts->nmemb - dropped;
+    ts->root = NULL;
+    ts->nmemb = 0;
+    if (ts->own_alloc)
+        drop_pool(ts);
+    if (!td->nmemb && td->own_alloc)
+        drop_pool(td);
+}
+
+struct par_walk {
+    avltree_exec *ex;
+    avltree_tree *t;
+    avltree_node *r;
+    int h;
+    void (*visit)(void *, avltree_node *);
+    void *ctx;
+    /* For avltree_par_free(): FLAGS and whether nodes are freed. */
+    unsigned char flags, nodes;
+};
+
+static void visit_task(arg)
+void *arg;
+{
+    struct par_walk *w, l, r;
+    avltree_node *n;
+    avl_walk aw;
+
+    w = arg;
+    if (w->h <= AVL_PAR_HEIGHT || !w->ex) {
+        walk_prefix(&aw, w->r);
+        while ((n = next_prefix(&aw)))
+            w->visit(w->ctx, n);
+        return;
+    }
+    l = r = *w;
+    l.r = w->r->child[0];
+    l.h = w->h - (AVL_BF(w->r) > 0? 2 : 1);
+    r.r = w->r->child[1];
+    r.h = w->h - (AVL_BF(w->r) < 0? 2 : 1);
+    fork2(w->ex, 1, visit_task, &l, &r);
+    w->visit(w->ctx, w->r);
+}
+
+void avltree_par_visit(ex, t, visit, ctx)
+avltree_exec *ex;
+avltree_tree *t;
+void (*visit)(void *, avltree_node *);
+void *ctx;
+{
+    struct par_walk w;
+
+    w.ex = ex;
+    w.t = t;
+    w.r = t->root;
+    w.h = subtree_height(t->root);
+    w.visit = visit;
+    w.ctx = ctx;
+    visit_task(&w);
+}
+
+static void free_task(arg)
+void *arg;
+{
+    struct par_walk *w, l, r;
+#ifdef AVLTREE_STATS
+    avltree_tree lt, rt;
+#endif
+
+    w = arg;
+    if (w->h <= AVL_PAR_HEIGHT || !w->ex) {
+        free_subtree(w->t, w->r, w->flags, w->nodes);
+        return;
+    }
+    l = r = *w;
+    l.r = w->r->child[0];
+    l.h = w->h - (AVL_BF(w->r) > 0? 2 : 1);
+    r.r = w->r->child[1];
+    r.h = w->h - (AVL_BF(w->r) < 0? 2 : 1);
+#ifdef AVLTREE_STATS
+    stats_fork(w->t, &lt, &rt);
+    l.t = &lt;
+    r.t = &rt;
+#endif
+    fork2(w->ex, 1, free_task, &l, &r);
+#ifdef AVLTREE_STATS
+    stats_join(w->t, &lt, &rt);
+#endif
+    l.r = w->r;
+    l.r->child[0] = l.r->child[1] = NULL;
+    free_subtree(w->t, l.r, w->flags, w->nodes);
+}
+
+void avltree_par_free(ex, t, flags)
+avltree_exec *ex;
+avltree_tree *t;
+unsigned char flags;
+{
+    struct par_walk w;
+
+    if (!t->root)
+        return;
+    if (t->alloc && !AVL_BULK(t)) {
+        /* Nodes go back one by one to an allocator that may not be
+           thread safe. */
+        free_subtree(t, t->root, flags, 1);
+        if (t->own_alloc)
+            drop_pool(t);
+    } else {
+        w.ex = ex;
+        w.t = t;
+        w.r = t->root;
+        w.h = subtree_height(t->root);
+        w.flags = flags;
+        /* free() is thread safe. */
+        w.nodes = !t->alloc;
+        free_task(&w);
+        if (t->alloc)
+            release_nodes(t);
+    }
+    t->root = NULL;
+    t->nmemb = 0;
+}
+
+avl_delete_range(t, lo, hi, flags)
+avltree_tree *t;
+void *lo, *hi;
+unsigned char flags;
+{
+    avltree_node *l, *m, *g;
+    int lh, mh, gh, n;
+
+    l = NULL;
+    lh = 0;
+    m = t->root;
+    mh = subtree_height(m);
+    if (lo)
+        split(t, m, lo, &l, &lh, &m, &mh);
+    g = NULL;
+    gh = 0;
+    if (hi)
+        split(t, m, hi, &m, &mh, &g, &gh);
+    n = count_nodes(m);
+    free_subtree(t, m, flags, 1);
+    t->root = concat(t, l, lh, g, gh, &mh);
+    t->nmemb -= n;
+    if (!t->nmemb && t->own_alloc)
+        drop_pool(t);
+    return n;
+}
+
+/* Persistent trees: */
+
+#define PHEIGHT(N) ((N)? (N)->height : 0)
+
+static avltree_pnode *pget(n)
+avltree_pnode *n;
+{
+    if (n)
+        __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+static void pput(n)
+avltree_pnode *n;
+{
+    if (!n || __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    pput(n->child[0]);
+    pput(n->child[1]);
+    free(n);
+}
+
+/* New node with x on SIDE and y on the other; takes their references. */
+static avltree_pnode *pnode(key, value, side, x, y)
+void *key, *value;
+unsigned char side;
+avltree_pnode *x, *y;
+{
+    avltree_pnode *n;
+
+    n = malloc(sizeof(avltree_pnode));
+    n->key = key;
+    n->value = value;
+    n->child[side] = x;
+    n->child[!side] = y;
+    n->height = (PHEIGHT(x) > PHEIGHT(y)? PHEIGHT(x) : PHEIGHT(y)) + 1;
+    n->refs = 1;
+    return n;
+}
+
+/* The retrace of a persistent tree: builds the node of KEY over children
+   whose heights differ by at most 2, rotating as needed. With no parent
+   pointers, heights replace the balance factors. */
+static avltree_pnode *pbalance(key, value, l, r)
+void *key, *value;
+avltree_pnode *l, *r;
+{
+    avltree_pnode *c, *m, *other, *res;
+    unsigned char s;
+
+    if (PHEIGHT(l) <= PHEIGHT(r) + 1 && PHEIGHT(r) <= PHEIGHT(l) + 1)
+        return pnode(key, value, 0, l, r);
+    /* c is the taller child, on side s. */
+    s = PHEIGHT(r) > PHEIGHT(l);
+    c = s? r : l;
+    other = s? l : r;
+    if (PHEIGHT(c->child[s]) >= PHEIGHT(c->child[!s]))
+        res = pnode(c->key, c->value, s, pget(c->child[s]),
+                    pnode(key, value, s, pget(c->child[!s]), other));
+    else {
+        m = c->child[!s];
+        res = pnode(m->key, m->value, s,
+                    pnode(c->key, c->value, s, pget(c->child[s]), pget(m->child[s])),
+                    pnode(key, value, s, pget(m->child[!s]), other));
+    }
+    pput(c);
+    return res;
+}
+
+static avltree_pnode *pinsert(t, n, key, value)
+avltree_ptree *t;
+avltree_pnode *n;
+void *key, *value;
+{
+    int cmp;
+
+    if (!n)
+        return pnode(key, value, 0, NULL, NULL);
+    cmp = t->compar(key, n->key);
+    if (!cmp && t->inplace)
+        return pnode(n->key, value, 0, pget(n->child[0]), pget(n->child[1]));
+    /* Equal keys go to the left. */
+    if (cmp > 0)
+        return pbalance(n->key, n->value, pget(n->child[0]),
+                        pinsert(t, n->child[1], key, value));
+    return pbalance(n->key, n->value, pinsert(t, n->child[0], key, value),
+                    pget(n->child[1]));
+}
+
+static avltree_pnode *premove_min(n, key, value)
+avltree_pnode *n;
+void **key, **value;
+{
+    if (!n->child[0]) {
+        *key = n->key;
+        *value = n->value;
+        return pget(n->child[1]);
+    }
+    return pbalance(n->key, n->value, premove_min(n->child[0], key, value),
+                    pget(n->child[1]));
+}
+
+/* KEY must be in n. */
+static avltree_pnode *premove(t, n, key)
+avltree_ptree *t;
+avltree_pnode *n;
+void *key;
+{
+    void *k, *v;
+    avltree_pnode *r;
+    int cmp;
+
+    if ((cmp = t->compar(key, n->key)) > 0)
+        return pbalance(n->key, n->value, pget(n->child[0]),
+                        premove(t, n->child[1], key));
+    if (cmp < 0)
+        return pbalance(n->key, n->value, premove(t, n->child[0], key),
+                        pget(n->child[1]));
+    if (!n->child[0] || !n->child[1])
+        return pget(n->child[!n->child[0]]);
+    r = premove_min(n->child[1], &k, &v);
+    return pbalance(k, v, pget(n->child[0]), r);
+}
+
+static void pset(dst, src, root, nmemb)
+avltree_ptree *dst, *src;
+avltree_pnode *root;
+{
+    if (dst == src)
+        pput(dst->root);
+    else {
+        dst->compar = src->compar;
+        dst->inplace = src->inplace;
+    }
+    dst->root = root;
+    dst->nmemb = nmemb;
+}
+
+void avltree_psnapshot(dst, src)
+avltree_ptree *dst, *src;
+{
+    if (dst != src)
+        pset(dst, src, pget(src->root), src->nmemb);
+}
+
+void avltree_pinsert(dst, src, key, value)
+avltree_ptree *dst, *src;
+void *key, *value;
+{
+    int nmemb;
+
+    nmemb = src->nmemb + !(src->inplace && avltree_pfind(src, key));
+    pset(dst, src, pinsert(src, src->root, key, value), nmemb);
+}
+
+avltree_premove(dst, src, key)
+avltree_ptree *dst, *src;
+void *key;
+{
+    if (!avltree_pfind(src, key))
+        return 1;
+    pset(dst, src, premove(src, src->root, key), src->nmemb - 1);
+    return 0;
+}
+
+void avltree_prelease(t)
+avltree_ptree *t;
+{
+    pput(t->root);
+    t->root = NULL;
+    t->nmemb = 0;
+}
+
+avltree_pnode *avltree_pfind(t, key)
+avltree_ptree *t;
+void *key;
+{
+    avltree_pnode *n;
+    int cmp;
+
+    for (n = t->root; n && (cmp = t->compar(key, n->key)); )
+        n = n->child[cmp > 0];
+    return n;
+}
+
+avltree_prange(t, lo, hi, visit, ctx)
+avltree_ptree *t;
+void *lo, *hi, *ctx;
+int (*visit)(void *, void *, void *);
+{
+    avltree_pnode *stack[AVL_MAX_HEIGHT], *n;
+    int top, ret;
+
+    /* The path to the first key >= lo, less its right turns. */
+    for (top = 0, n = t->root; n; )
+        if (!lo || t->compar(lo, n->key) <= 0) {
+            stack[top++] = n;
+            n = n->child[0];
+        } else
+            n = n->child[1];
+    while (top) {
+        n = stack[--top];
+        if (hi && t->compar(n->key, hi) >= 0)
+            break;
+        if ((ret = visit(ctx, n->key, n->value)))
+            return ret;
+        for (n = n->child[1]; n; n = n->child[0])
+            stack[top++] = n;
+    }
+    return 0;
+}
+
+/* Frozen snapshots: */
+
+#ifdef __GNUC__
+#define AVL_PREFETCH(P) __builtin_prefetch(P)
+#else
+#define AVL_PREFETCH(P) ((void)0)
+#endif
+
+int avltree_frozen_first(f)
+avltree_frozen *f;
+{
+    int i;
+
+    if (!f->nmemb)
+        return 0;
+    for (i = 1; 2*i <= f->nmemb; i *= 2)
+        ;
+    return i;
+}
+
+int avltree_frozen_next(f, i)
+avltree_frozen *f;
+int i;
+{
+    if (2*i + 1 <= f->nmemb)
+        for (i = 2*i + 1; 2*i <= f->nmemb; i *= 2)
+            ;
+    else {
+        /* Up past the left children, then once more. */
+        while (i & 1)
+            i >>= 1;
+        i >>= 1;
+    }
+    return i;
+}
+
+avltree_freeze(t, f, key_size)
+avltree_tree *t;
+avltree_frozen *f;
+size_t key_size;
+{
+    avltree_node *n;
+    int i;
+
+    f->nmemb = t->nmemb;
+    f->compar = t->compar;
+    f->key_size = key_size;
+    f->keys = NULL;
+    f->block = NULL;
+    f->values = NULL;
+    if (key_size)
+        f->block = malloc(key_size * (t->nmemb + 1));
+    else
+        f->keys = malloc(sizeof(void *) * (t->nmemb + 1));
+#ifndef AVLTREE_NO_VALUE
+    f->values = malloc(sizeof(void *) * (t->nmemb + 1));
+    if (!f->values) {
+        avltree_frozen_destroy(f);
+        return 1;
+    }
+#endif
+    if (!f->keys && !f->block) {
+        avltree_frozen_destroy(f);
+        return 1;
+    }
+    for (n = avl_find_min(t, t->root), i = avltree_frozen_first(f); n;
+         n = avl_next(n), i = avltree_frozen_next(f, i)) {
+        if (key_size)
+            memcpy(f->block + i * key_size, n->key, key_size);
+        else
+            f->keys[i] = n->key;
+#ifndef AVLTREE_NO_VALUE
+        f->values[i] = AVL_VALUE(n);
+#endif
+    }
+    return 0;
+}
+
+void avltree_frozen_destroy(f)
+avltree_frozen *f;
+{
+    free(f->keys);
+    free(f->block);
+    free(f->values);
+    f->keys = f->values = NULL;
+    f->block = NULL;
+    f->nmemb = 0;
+}
+
+/* Branch-free descent: the slot reached encodes the path taken, and its
+   last left turn is the lower bound. The 16 descendants 4 levels down (8 and
+   3 for key pointers) are contiguous, so they are prefetched early. */
+int avltree_frozen_lower_bound(f, key)
+avltree_frozen *f;
+void *key;
+{
+    int k, n;
+
+    n = f->nmemb;
+    k = 1;
+    if (f->key_size)
+        while (k <= n) {
+            AVL_PREFETCH(f->block + (size_t)k * 16 * f->key_size);
+            k = 2*k + (f->compar(f->block + k * f->key_size, key) < 0);
+        }
+    else
+        while (k <= n) {
+            AVL_PREFETCH(f->keys + (size_t)k * 8);
+            k = 2*k + (f->compar(f->keys[k], key) < 0);
+        }
+    while (k & 1)
+        k >>= 1;
+    return k >> 1;
 }
 
-void avl_empty(t, r)
-avltree_tree *t;
-avltree_node *r;
+int avltree_frozen_find(f, key)
+avltree_frozen *f;
+void *key;
 {
-    if (!r)
-        return;
-    avl_empty(t, r->child[0]);
-    avl_empty(t, r->child[1]);
-    free(r);
+    int i;
+
+    i = avltree_frozen_lower_bound(f, key);
+    return i && !f->compar(AVL_FROZEN_KEY(f, i), key)? i : 0;
 }
 
-void avl_copy_keys(td, ts, r)
-avltree_tree *td, *ts;
-avltree_node *r;
+avltree_frozen_range(f, lo, hi, visit, ctx)
+avltree_frozen *f;
+void *lo, *hi, *ctx;
+int (*visit)(void *, void *, void *);
 {
-    if (!r)
-        return;
-    avl_copy_keys(td, ts, r->child[0]);
-    avl_copy_keys(td, ts, r->child[1]);
-    avltree_insert(td, r->key, NULL);
+    int i, ret;
+
+    i = lo? avltree_frozen_lower_bound(f, lo) : avltree_frozen_first(f);
+    for (; i && (!hi || f->compar(AVL_FROZEN_KEY(f, i), hi) < 0);
+         i = avltree_frozen_next(f, i))
+        if ((ret = visit(ctx, AVL_FROZEN_KEY(f, i), AVL_FROZEN_VALUE(f, i))))
+            return ret;
+    return 0;
 }
 
-void avl_destroy(t, r)
-avltree_tree *t;
-avltree_node *r;
+/* Frozen int64_t snapshots: */
+
+#define B64 AVLTREE_B64
+#define CHILD64(B, I) ((B) * (B64 + 1) + 1 + (I))
+/* Probes searched together by avltree_frozen64_find_batch(). */
+#define BATCH64 16
+
+/* Lays the sorted keys out in order, recursively from block b. */
+static void fill64(f, sorted, pos, b)
+avltree_frozen64 *f;
+avltree_node **sorted;
+int *pos, b;
 {
-    if (!r)
+    int i;
+
+    if (b >= f->nblocks)
         return;
-    avl_destroy(t, r->child[0]);
-    avl_destroy(t, r->child[1]);
-    free(r->key);
-    if (r->has_value) free(r->value);
-    free(r);
+    for (i=0; i < B64; i++) {
+        fill64(f, sorted, pos, CHILD64(b, i));
+        if (*pos < f->nmemb) {
+            f->keys[b*B64 + i] = *(int64_t *)sorted[*pos]->key;
+            f->rank[b*B64 + i] = *pos;
+            f->values[*pos] = AVL_VALUE(sorted[*pos]);
+            ++*pos;
+        } else {
+            f->keys[b*B64 + i] = INT64_MAX;
+            f->rank[b*B64 + i] = f->nmemb;
+        }
+    }
+    fill64(f, sorted, pos, CHILD64(b, B64));
 }
 
-avltree_node *avl_find_max(t, r)
+avltree_freeze64(t, f)
 avltree_tree *t;
-avltree_node *r;
+avltree_frozen64 *f;
 {
-    if (!r) return NULL;
-    if (r->child[1])
-        return avl_find_max(t, r->child[1]);
-    return r;
+    avltree_node **sorted, *n;
+    int i, slots;
+
+    f->nmemb = t->nmemb;
+    f->nblocks = (t->nmemb + B64 - 1) / B64;
+    slots = f->nblocks * B64;
+    f->mem = malloc(sizeof(int64_t) * slots + 64);
+    f->rank = malloc(sizeof(int) * slots);
+    f->values = malloc(sizeof(void *) * (t->nmemb + 1));
+    sorted = malloc(sizeof(avltree_node *) * (t->nmemb + 1));
+    if (!f->mem || !f->rank || !f->values || !sorted) {
+        free(sorted);
+        avltree_frozen64_destroy(f);
+        return 1;
+    }
+    /* Blocks start on a cache line. */
+    f->keys = (int64_t *)(((uintptr_t)f->mem + 63) & ~(uintptr_t)63);
+    for (n = avl_find_min(t, t->root), i = 0; n; n = avl_next(n))
+        sorted[i++] = n;
+    i = 0;
+    fill64(f, sorted, &i, 0);
+    free(sorted);
+    return 0;
 }
 
-avltree_node *avl_find_min(t, r)
-avltree_tree *t;
-avltree_node *r;
+void avltree_frozen64_destroy(f)
+avltree_frozen64 *f;
 {
-    if (!r) return NULL;
-    if (r->child[0])
-        return avl_find_min(t, r->child[0]);
-    return r;
+    free(f->mem);
+    free(f->rank);
+    free(f->values);
+    f->mem = f->keys = NULL;
+    f->rank = NULL;
+    f->values = NULL;
+    f->nmemb = f->nblocks = 0;
 }
 
-static avltree_node *find_leaf_avl(t, r, key)
-avltree_tree *t;
-avltree_node *r;
-void *key;
+/* Number of keys of a block less than x. */
+static int rank_scalar(k, x)
+const int64_t *k;
+int64_t x;
 {
-    int gt;
+    int i, c;
 
-    if (!r) return NULL;
-    gt = t->compar(key, r->key) > 0;
-    if (!r->child[gt])
-        return r;
-    return find_leaf_avl(t, r->child[gt], key);
+    for (i = c = 0; i < B64; i++)
+        c += k[i] < x;
+    return c;
 }
 
-avltree_node *avl_find_node(t, r, key, parent)
-avltree_tree *t;
-avltree_node *r, **parent;
-void *key;
+#ifdef AVL_X86
+__attribute__((target("avx2")))
+static int rank_avx2(const int64_t *k, int64_t x)
 {
-    int cmp;
-    
-    if (!r) return NULL;
-    if (!(cmp = t->compar(key, r->key)))
-        return r;
-    if (parent)
-        *parent = r;
-    return avl_find_node(t, r->child[cmp > 0], key, parent);
+    __m256i v, a, b;
+
+    v = _mm256_set1_epi64x(x);
+    a = _mm256_cmpgt_epi64(v, _mm256_load_si256((const __m256i *)k));
+    b = _mm256_cmpgt_epi64(v, _mm256_load_si256((const __m256i *)(k + 4)));
+    return __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(a))
+                              | _mm256_movemask_pd(_mm256_castsi256_pd(b)) << 4);
 }
 
-/* Least mirroed alg. */
-static void retrace(t, x, z, inc, removed)
-avltree_tree *t;
-avltree_node *x, *z;
-unsigned char removed;
+__attribute__((target("sse4.2")))
+static int rank_sse42(const int64_t *k, int64_t x)
 {
-    int orig_bf, bf_z0, bf_y0;
-    unsigned char side_x;
-    avltree_node *y;
+    __m128i v;
+    int i, m;
 
-    if (!x)
-        return;
+    v = _mm_set1_epi64x(x);
+    for (i = m = 0; i < B64; i += 2)
+        m |= _mm_movemask_pd(_mm_castsi128_pd(
+                 _mm_cmpgt_epi64(v, _mm_load_si128((const __m128i *)(k + i))))) << i;
+    return __builtin_popcount(m);
+}
+#endif
 
-    orig_bf = x->bf;
-    x->bf += inc;
-    
-    /* Apply rotations. */
-    if (x->parent)
-        side_x = x->parent->child[1] == x;
-    /* R */
-    if (x->bf/2 > 0) {
-        bf_z0 = z->bf;
-        /* R */
-        if (bf_z0 >= 0) {
-            if (x->parent)
-                x->parent->child[side_x] = z;
-            else
-                t->root = z;
-            z->parent = x->parent;
-            x->child[1] = z->child[0];
-            if (z->child[0])
-                z->child[0]->parent = x;
-            z->child[0] = x;
-            x->parent = z;
-            
-            /* Update BFs. */
-            x->bf = -bf_z0 + 1;
-            z->bf = bf_z0 - 1;
-            /* New x: */
-            x = z;
-        /* L */
-        } else {
-            y = z->child[0];
-            if (x->parent)
-                x->parent->child[side_x] = y;
-            else
-                t->root = y;
-            y->parent = x->parent;
-            x->child[1] = y->child[0];
-            if (y->child[0])
-                y->child[0]->parent = x;
-            y->child[0] = x;
-            x->parent = y;
-            z->child[0] = y->child[1];
-            if (y->child[1])
-                y->child[1]->parent = z;
-            y->child[1] = z;
-            z->parent = y;
-            
-            /* Update BFs. */
-            bf_y0 = y->bf;
-            if (bf_y0 < 0) {
-                x->bf = 0;
-                z->bf = 1;
-            } else {
-                x->bf = -bf_y0;    
-                z->bf = 0;
-            }
-            y->bf = 0;
-            /* New x: */
-            x = y;
+static int (*rank64)(const int64_t *, int64_t);
+
+static void init_rank64()
+{
+    rank64 = rank_scalar;
+#ifdef AVL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        rank64 = rank_avx2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        rank64 = rank_sse42;
+#endif
+}
+
+avltree_frozen64_lower_bound(f, key)
+avltree_frozen64 *f;
+int64_t key;
+{
+    int b, i, res;
+
+    if (!rank64)
+        init_rank64();
+    res = f->nmemb;
+    for (b = 0; b < f->nblocks; b = CHILD64(b, i))
+        if ((i = rank64(f->keys + b*B64, key)) < B64)
+            res = f->rank[b*B64 + i];
+    return res;
+}
+
+avltree_frozen64_find(f, key)
+avltree_frozen64 *f;
+int64_t key;
+{
+    int b, i, res;
+
+    if (!rank64)
+        init_rank64();
+    res = -1;
+    for (b = 0; b < f->nblocks; b = CHILD64(b, i))
+        if ((i = rank64(f->keys + b*B64, key)) < B64 && f->keys[b*B64 + i] == key)
+            res = f->rank[b*B64 + i];
+    /* The padding is INT64_MAX. */
+    return res < f->nmemb? res : -1;
+}
+
+/* Advances BATCH64 searches one level at a time, prefetching the next block
+   of each, so that the misses of a level are served together. */
+void avltree_frozen64_find_batch(f, keys, n, out)
+avltree_frozen64 *f;
+const int64_t *keys;
+int n, *out;
+{
+    int blk[BATCH64], i, j, m, c, live;
+
+    if (!rank64)
+        init_rank64();
+    for (i=0; i < n; i += BATCH64) {
+        m = n - i < BATCH64? n - i : BATCH64;
+        for (j=0; j < m; j++) {
+            blk[j] = 0;
+            out[i + j] = -1;
         }
-    /* L */
-    } else if (x->bf/2 < 0) {
-        bf_z0 = z->bf;
-        /* R */
-        if (bf_z0 > 0) {
-            y = z->child[1];
-            if (x->parent)
-                x->parent->child[side_x] = y;
-            else
-                t->root = y;
-            y->parent = x->parent;
-            x->child[0] = y->child[1];
-            if (y->child[1])
-                y->child[1]->parent = x;
-            y->child[1] = x;
-            x->parent = y;
-            z->child[1] = y->child[0];
-            if (y->child[0])
-                y->child[0]->parent = z;
-            y->child[0] = z;
-            z->parent = y;
-            
-            /* Update BFs. */
-            bf_y0 = y->bf;
-            if (bf_y0 > 0) {
-                x->bf = 0;
-                z->bf = -1;
-            } else {
-                x->bf = -bf_y0;    
-                z->bf = 0;
+        for (live = f->nblocks > 0; live; ) {
+            live = 0;
+            for (j=0; j < m; j++) {
+                if (blk[j] >= f->nblocks)
+                    continue;
+                c = rank64(f->keys + blk[j]*B64, keys[i + j]);
+                if (c < B64 && f->keys[blk[j]*B64 + c] == keys[i + j])
+                    out[i + j] = f->rank[blk[j]*B64 + c];
+                blk[j] = CHILD64(blk[j], c);
+                if (blk[j] < f->nblocks) {
+                    AVL_PREFETCH(f->keys + blk[j]*B64);
+                    live = 1;
+                }
             }
-            y->bf = 0;
-            /* New x: */
-            x = y;
-        /* L */
-        } else {
-            if (x->parent)
-                x->parent->child[side_x] = z;
-            else
-                t->root = z;
-            z->parent = x->parent;
-            x->child[0] = z->child[1];
-            if (z->child[1])
-                z->child[1]->parent = x;
-            z->child[1] = x;
-            x->parent = z;
-            
-            /* Update BFs. */
-            x->bf = -bf_z0 - 1;
-            z->bf = bf_z0 + 1;
-            /* New x: */
-            x = z;
         }
-    }
-    /* If it balanced, it means that the increment or decrement was canceled */
-    /* out for the ancestors. */
-    if (removed ^ (x->bf != 0)) {
-        inc = abs(x->bf - orig_bf);
-        retrace(t, x->parent, x->parent? x->parent->child[removed? x->parent->bf > 0: side_x] : x,
-                removed ^ side_x? inc : -inc, removed);
+        for (j=0; j < m; j++)
+            if (out[i + j] == f->nmemb)
+                out[i + j] = -1;
     }
 }
 
-avltree_node *avltree_insert(t, key, value)
+/* Binary snapshots: */
+
+#define ALIGN8(N) (((N) + 7) & ~(uint64_t)7)
+
+/* Fills the records of t in pre-order, with the offsets its keys and values
+   will have after them. Returns where the data ends. */
+static uint64_t make_records(t, c, rec)
 avltree_tree *t;
-void *key, *value;
+avltree_codec *c;
+avltree_record *rec;
 {
-    avltree_node *node, *parent, *new;
-    int gt;
-    
-    /* Commom insert in bst. **** */
-    parent = NULL;
-    if ((node = avl_find_node(t, t->root, key, &parent)) && t->inplace) {
-        if (node->has_value) {
-            node->has_value = 0;
-            free(node->value);
+    avltree_node *stack[AVL_MAX_HEIGHT + 1], *n;
+    /* Record of the parent << 1 | side, or -1. */
+    int parent[AVL_MAX_HEIGHT + 1], top, i, p;
+    uint64_t off;
+    size_t len;
+
+    off = sizeof(avltree_file_header) + (uint64_t)t->nmemb * sizeof(avltree_record);
+    top = 0;
+    stack[top] = t->root;
+    parent[top++] = -1;
+    for (i=0; top; i++) {
+        n = stack[--top];
+        p = parent[top];
+        memset(&rec[i], 0, sizeof(avltree_record));
+        if (p >= 0 && p & 1)
+            rec[p >> 1].right = i;
+        else if (p >= 0)
+            rec[p >> 1].left = 1;
+        rec[i].bf = AVL_BF(n);
+        c->save_key(c->ctx, n->key, &len);
+        rec[i].key = off;
+        rec[i].key_len = len;
+        off = ALIGN8(off + len);
+        if (c->save_value && AVL_HAS_VALUE(n)) {
+            c->save_value(c->ctx, AVL_VALUE(n), &len);
+            rec[i].value = off;
+            rec[i].value_len = len;
+            off = ALIGN8(off + len);
         }
-        if (value) {
-            node->has_value = 1;
-            node->value = value;
+        /* The left child is popped first, to come right after n. */
+        if (n->child[1]) {
+            stack[top] = n->child[1];
+            parent[top++] = i << 1 | 1;
         }
-        free(key);
-        return node;
-    } else
-        parent = find_leaf_avl(t, node? node : t->root, key);
-    if (parent) {
-        gt = t->compar(key, parent->key) > 0;
-        new = parent->child[gt] = malloc(sizeof(avltree_node));
-    } else
-        new = t->root = malloc(sizeof(avltree_node));
-    new->parent = parent;
-    new->key = key;
-    if (value) {
-        new->value = value;
-        new->has_value = 1;
-    } else
-        new->has_value = 0;
-    new->child[0] = new->child[1] = NULL;
-    new->bf = 0;
-    t->nmemb++;
-    /* **** */
-    if (parent)
-        retrace(t, parent, new, gt * 2 - 1, 0);
-    return new;
+        if (n->child[0]) {
+            stack[top] = n->child[0];
+            parent[top++] = i << 1;
+        }
+    }
+    return off;
 }
 
-void avl_remove(t, z, flags)
+/* Writes LEN bytes and pads them to 8. */
+static put_bytes(stream, data, len)
+FILE *stream;
+const void *data;
+size_t len;
+{
+    static const char zero[8];
+
+    return fwrite(data, 1, len, stream) != len ||
+           fwrite(zero, 1, ALIGN8(len) - len, stream) != ALIGN8(len) - len;
+}
+
+avltree_save(t, stream, c)
 avltree_tree *t;
-avltree_node *z;
-unsigned char flags;
+FILE *stream;
+avltree_codec *c;
 {
-    avltree_node *y, *q, *parenty;
-    unsigned char side_z, two;
-    int inc;
+    avltree_file_header h;
+    avltree_record *rec;
+    const void *data;
+    avltree_node *n;
+    avl_walk w;
+    size_t len;
+    int err;
 
-    assert(z);
-    q = z->parent;
-    two = 0;
-    if (z->child[0] && z->child[1]) {
-        y = avl_find_max(t, z->child[0]);
-        parenty = y->parent;
-        if (parenty != z) {
-            parenty->child[1] = y->child[0];
-            if (y->child[0])
-                y->child[0]->parent = parenty;
-            y->child[0] = z->child[0];
-            z->child[0]->parent = y;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, AVLTREE_FILE_MAGIC, sizeof(AVLTREE_FILE_MAGIC));
+    h.version = AVLTREE_FILE_VERSION;
+    h.height = subtree_height(t->root);
+    h.nmemb = t->nmemb;
+    if (!(rec = malloc(sizeof(avltree_record) * (t->nmemb + 1))))
+        return 1;
+    if (t->root)
+        make_records(t, c, rec);
+    err = fwrite(&h, sizeof(h), 1, stream) != 1 ||
+          fwrite(rec, sizeof(avltree_record), t->nmemb, stream) != t->nmemb;
+    free(rec);
+    /* The data, in the order make_records() laid it out. */
+    walk_prefix(&w, t->root);
+    while (!err && (n = next_prefix(&w))) {
+        data = c->save_key(c->ctx, n->key, &len);
+        err = put_bytes(stream, data, len);
+        if (!err && c->save_value && AVL_HAS_VALUE(n)) {
+            data = c->save_value(c->ctx, AVL_VALUE(n), &len);
+            err = put_bytes(stream, data, len);
         }
-        y->child[1] = z->child[1];
-        z->child[1]->parent = y;
-        two = 1;
-        /* Update Y BF */
-        y->bf = z->bf;
-    } else
-        y = z->child[0]? z->child[0] : z->child[1];
-    if (q) {
-        side_z = q->child[1] == z;
-        q->child[side_z] = y;    
-    } else
-        t->root = y;
-    if (y)
-        y->parent = q;
-    
-    if (flags & AVLTREE_FREE_VALUE && z->has_value)
-        free(z->value);
-    if (flags & AVLTREE_FREE_KEY)
-        free(z->key);
-    free(z);
-    t->nmemb--;
+    }
+    return err || fflush(stream);
+}
 
-    /* Update BFs */
-    if (y && two) {
-        if (parenty == z) {
-            parenty = y;
-            inc = 1;
-        } else
-            inc = -1;
-        retrace(t, parenty, parenty->child[parenty->bf > 0], inc, 1);
-    } else if (q)
-        retrace(t, q, q->child[!(q->bf || side_z) ||
-                q->bf > 0],
-                side_z? -1 : 1, 1);
+static check_header(h)
+avltree_file_header *h;
+{
+    return memcmp(h->magic, AVLTREE_FILE_MAGIC, sizeof(AVLTREE_FILE_MAGIC)) ||
+           h->version != AVLTREE_FILE_VERSION || h->nmemb > (uint64_t)INT32_MAX;
 }
 
-avltree_remove(t, key, flags)
+/* Whether LEN bytes at OFF lie in [start, size). */
+#define IN_DATA(OFF, LEN, START, SIZE) \
+    ((OFF) >= (START) && (OFF) <= (SIZE) && (LEN) <= (SIZE) - (OFF))
+
+/* Checks that the records of a file of SIZE bytes, whose data begins at
+   START, point inside the data and form an AVL tree rooted at the first:
+   every other record is the child of exactly one before it, and every bf
+   is the difference of the heights below. */
+static check_records(rec, n, start, size)
+avltree_record *rec;
+uint64_t start, size;
+{
+    /* Height of the subtree of each record, negated once it has a parent. */
+    int *h, i, lh, rh, err;
+
+    if (!n)
+        return 0;
+    if (!(h = malloc(sizeof(int) * n)))
+        return 1;
+    err = 0;
+    for (i = n - 1; !err && i >= 0; i--) {
+        err = !IN_DATA(rec[i].key, rec[i].key_len, start, size) ||
+              (rec[i].value? !IN_DATA(rec[i].value, rec[i].value_len, start, size) :
+                             rec[i].value_len != 0) ||
+              (rec[i].left && i + 1 >= n) ||
+              (rec[i].right && (rec[i].right <= i || rec[i].right >= n));
+        if (err)
+            break;
+        lh = rec[i].left? h[i + 1] : 0;
+        rh = rec[i].right? h[rec[i].right] : 0;
+        if (rec[i].left)
+            h[i + 1] = -lh;
+        if (rec[i].right)
+            h[rec[i].right] = -rh;
+        h[i] = (lh > rh? lh : rh) + 1;
+        err = lh < 0 || rh < 0 || rec[i].bf != rh - lh || rec[i].bf < -1 || rec[i].bf > 1;
+    }
+    for (i=1; !err && i < n; i++)
+        err = h[i] > 0;
+    free(h);
+    return err;
+}
+
+avltree_load(t, stream, c)
 avltree_tree *t;
-void *key;
-unsigned char flags;
+FILE *stream;
+avltree_codec *c;
 {
-    avltree_node *z;
-    
-    if (!(z = avl_find_node(t, t->root, key, NULL)))
+    avltree_file_header h;
+    avltree_record *rec;
+    avltree_node **nodes, *n;
+    unsigned char *data;
+    uint64_t start, end;
+    int i, nmemb;
+
+    if (t->root || fread(&h, sizeof(h), 1, stream) != 1 || check_header(&h))
         return 1;
-    avl_remove(t, z, flags);
+    if (!(nmemb = h.nmemb))
+        return 0;
+    rec = malloc(sizeof(avltree_record) * nmemb);
+    nodes = malloc(sizeof(avltree_node *) * nmemb);
+    data = NULL;
+    if (!rec || !nodes || fread(rec, sizeof(avltree_record), nmemb, stream) != nmemb)
+        goto fail;
+    start = sizeof(h) + (uint64_t)nmemb * sizeof(avltree_record);
+    /* The stream has no known size; the read of the data bounds it. */
+    if (check_records(rec, nmemb, start, UINT64_MAX))
+        goto fail;
+    for (end = start, i=0; i < nmemb; i++) {
+        if (rec[i].key + rec[i].key_len > end)
+            end = rec[i].key + rec[i].key_len;
+        if (rec[i].value + rec[i].value_len > end)
+            end = rec[i].value + rec[i].value_len;
+    }
+    if (!(data = malloc(end - start + 1)) ||
+        fread(data, 1, end - start, stream) != end - start)
+        goto fail;
+    if (!t->alloc && own_pool_init(t, nmemb))
+        goto fail;
+    for (i=0; i < nmemb; i++)
+        nodes[i] = avl_alloc_node(t, sizeof(avltree_node));
+    /* Children before parents, for update(). */
+    for (i = nmemb - 1; i >= 0; i--) {
+        n = nodes[i];
+        n->key = c->load_key(c->ctx, data + rec[i].key - start, rec[i].key_len);
+        AVL_SET_VALUE(n, rec[i].value && c->load_value?
+                      c->load_value(c->ctx, data + rec[i].value - start, rec[i].value_len) : NULL);
+        n->child[0] = rec[i].left? nodes[i + 1] : NULL;
+        n->child[1] = rec[i].right? nodes[rec[i].right] : NULL;
+        if (n->child[0])
+            AVL_SET_PARENT(n->child[0], n);
+        if (n->child[1])
+            AVL_SET_PARENT(n->child[1], n);
+        AVL_SET_BF(n, rec[i].bf);
+        AVL_SET_COUNT(n, 1);
+        update(t, n);
+    }
+    AVL_SET_PARENT(nodes[0], NULL);
+    t->root = nodes[0];
+    t->nmemb = nmemb;
+    free(rec);
+    free(nodes);
+    free(data);
+    return 0;
+fail:
+    free(rec);
+    free(nodes);
+    free(data);
+    return 1;
+}
+
+#ifdef AVL_MMAP
+avltree_map(m, path, compar)
+avltree_mapped *m;
+const char *path;
+int (*compar)(const void *, const void *);
+{
+    avltree_file_header *h;
+    struct stat st;
+    void *base;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 1;
+    if (fstat(fd, &st) || st.st_size < sizeof(avltree_file_header)) {
+        close(fd);
+        return 1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return 1;
+    h = base;
+    m->base = base;
+    m->size = st.st_size;
+    m->rec = (avltree_record *)(m->base + sizeof(avltree_file_header));
+    m->compar = compar;
+    m->nmemb = h->nmemb;
+    if (check_header(h) || sizeof(*h) + h->nmemb * sizeof(avltree_record) > m->size ||
+        check_records(m->rec, m->nmemb, sizeof(*h) + h->nmemb * sizeof(avltree_record), m->size)) {
+        munmap(base, st.st_size);
+        return 1;
+    }
     return 0;
 }
 
+void avltree_unmap(m)
+avltree_mapped *m;
+{
+    munmap(m->base, m->size);
+}
+#endif
+
+/* Descends the records as avl_find_node() or avl_lower_bound(). */
+static mapped_search(m, key, lower)
+avltree_mapped *m;
+void *key;
+unsigned char lower;
+{
+    int i, best, cmp;
+
+    best = -1;
+    for (i = m->nmemb? 0 : -1; i >= 0; ) {
+        cmp = m->compar(key, AVL_MAPPED_KEY(m, i));
+        if (!cmp && !lower)
+            return i;
+        if (cmp <= 0) {
+            if (lower)
+                best = i;
+            i = m->rec[i].left? i + 1 : -1;
+        } else
+            i = m->rec[i].right? (int)m->rec[i].right : -1;
+    }
+    return best;
+}
+
+avltree_mapped_find(m, key)
+avltree_mapped *m;
+void *key;
+{
+    return mapped_search(m, key, 0);
+}
+
+avltree_mapped_lower_bound(m, key)
+avltree_mapped *m;
+void *key;
+{
+    return mapped_search(m, key, 1);
+}
+
 /* Printing routines: */
 
 void avl_infix(stream, t, r, last)
@@ -379,14 +3355,27 @@ FILE *stream;
 avltree_tree *t;
 avltree_node *r, *last;
 {
-    if (!r)
-        return;
-    avl_infix(stream, t, r->child[0], last);
+    avltree_node *n;
+    avl_walk w;
+
+    walk_infix(&w, r);
+    while ((n = next_infix(&w))) {
+        if (t->stprint.print_fn)
+            t->stprint.print_fn(stream, n->key, AVL_VALUE(n));
+        if (last != n)
+            fprintf(stream, "%s", t->stprint.separator);
+    }
+}
+
+static void dump_node(stream, t, n)
+FILE *stream;
+avltree_tree *t;
+avltree_node *n;
+{
+    fprintf(stream, "%p ", n);
     if (t->stprint.print_fn)
-        t->stprint.print_fn(stream, r->key, r->value);
-    if (last != r)
-        fprintf(stream, "%s", t->stprint.separator);
-    avl_infix(stream, t, r->child[1], last);
+        t->stprint.print_fn(stream, n->key, AVL_VALUE(n));
+    fprintf(stream, " [%d] (%p, %p) ^%p", AVL_BF(n), n->child[0], n->child[1], AVL_PARENT(n));
 }
 
 void avl_dump_infix(stream, t, r, last)
@@ -394,16 +3383,15 @@ FILE *stream;
 avltree_tree *t;
 avltree_node *r, *last;
 {
-    if (!r)
-        return;
-    avl_dump_infix(stream, t, r->child[0], last);
-    fprintf(stream, "%p ", r);
-    if (t->stprint.print_fn)
-        t->stprint.print_fn(stream, r->key, r->value);
-    fprintf(stream, " [%d] (%p, %p) ^%p", r->bf, r->child[0], r->child[1], r->parent);
-    if (last != r)
-        putc('\n', stream);
-    avl_dump_infix(stream, t, r->child[1], last);
+    avltree_node *n;
+    avl_walk w;
+
+    walk_infix(&w, r);
+    while ((n = next_infix(&w))) {
+        dump_node(stream, t, n);
+        if (last != n)
+            putc('\n', stream);
+    }
 }
 
 void avl_prefix(stream, t, r)
@@ -411,14 +3399,16 @@ FILE *stream;
 avltree_tree *t;
 avltree_node *r;
 {
-    if (!r)
-        return;
-    if (r != t->root)
-        fprintf(stream, "%s", t->stprint.separator);
-    if (t->stprint.print_fn)
-        t->stprint.print_fn(stream, r->key, r->value);
-    avl_prefix(stream, t, r->child[0]);
-    avl_prefix(stream, t, r->child[1]);
+    avltree_node *n;
+    avl_walk w;
+
+    walk_prefix(&w, r);
+    while ((n = next_prefix(&w))) {
+        if (n != t->root)
+            fprintf(stream, "%s", t->stprint.separator);
+        if (t->stprint.print_fn)
+            t->stprint.print_fn(stream, n->key, AVL_VALUE(n));
+    }
 }
 
 void avl_dump_prefix(stream, t, r)
@@ -426,16 +3416,15 @@ FILE *stream;
 avltree_tree *t;
 avltree_node *r;
 {
-    if (!r)
-        return;
-    if (r != t->root)
-        putc('\n', stream);
-    fprintf(stream, "%p ", r);
-    if (t->stprint.print_fn)
-        t->stprint.print_fn(stream, r->key, r->value);
-    fprintf(stream, " [%d] (%p, %p) ^%p", r->bf, r->child[0], r->child[1], r->parent);
-    avl_dump_prefix(stream, t, r->child[0]);
-    avl_dump_prefix(stream, t, r->child[1]);
+    avltree_node *n;
+    avl_walk w;
+
+    walk_prefix(&w, r);
+    while ((n = next_prefix(&w))) {
+        if (n != t->root)
+            putc('\n', stream);
+        dump_node(stream, t, n);
+    }
 }
 
 void avl_posfix(stream, t, r)
@@ -443,14 +3432,16 @@ FILE *stream;
 avltree_tree *t;
 avltree_node *r;
 {
-    if (!r)
-        return;
-    avl_posfix(stream, t, r->child[0]);
-    avl_posfix(stream, t, r->child[1]);
-    if (t->stprint.print_fn)
-        t->stprint.print_fn(stream, r->key, r->value);
-    if (r != t->root)
-        fprintf(stream, "%s", t->stprint.separator);
+    avltree_node *n;
+    avl_walk w;
+
+    walk_posfix(&w, r);
+    while ((n = next_posfix(&w))) {
+        if (t->stprint.print_fn)
+            t->stprint.print_fn(stream, n->key, AVL_VALUE(n));
+        if (n != t->root)
+            fprintf(stream, "%s", t->stprint.separator);
+    }
 }
 
 void avl_dump_posfix(stream, t, r)
@@ -458,16 +3449,15 @@ FILE *stream;
 avltree_tree *t;
 avltree_node *r;
 {
-    if (!r)
-        return;
-    avl_dump_posfix(stream, t, r->child[0]);
-    avl_dump_posfix(stream, t, r->child[1]);
-    fprintf(stream, "%p ", r);
-    if (t->stprint.print_fn)
-        t->stprint.print_fn(stream, r->key, r->value);
-    fprintf(stream, " [%d] (%p, %p) ^%p", r->bf, r->child[0], r->child[1], r->parent);
-    if (r != t->root)
-        putc('\n', stream);
+    avltree_node *n;
+    avl_walk w;
+
+    walk_posfix(&w, r);
+    while ((n = next_posfix(&w))) {
+        dump_node(stream, t, n);
+        if (n != t->root)
+            putc('\n', stream);
+    }
 }
 
 /* Assumes that arr has sufficient capacity. */
@@ -478,13 +3468,39 @@ unsigned char *arr;
 size_t size;
 int *nmemb;
 {
-    if (!r)
-        return;
-    avl_keys_to_array(t, r->child[0], arr, size, nmemb, capacity);
-    assert(*nmemb < capacity);
-    memcpy(&arr[size**nmemb], r->key, size);
-    ++*nmemb;
-    avl_keys_to_array(t, r->child[1], arr, size, nmemb, capacity);
+    avltree_node *n;
+    avl_walk w;
+
+    walk_infix(&w, r);
+    while ((n = next_infix(&w))) {
+        assert(*nmemb < capacity);
+        memcpy(&arr[size**nmemb], n->key, size);
+        ++*nmemb;
+    }
+}
+
+/* Statistics: */
+
+#ifdef AVLTREE_STATS
+void avltree_stats_reset(t)
+avltree_tree *t;
+{
+    memset(&t->stats, 0, sizeof(avltree_stats));
+}
+
+void avltree_get_stats(t, s)
+avltree_tree *t;
+avltree_stats *s;
+{
+    *s = t->stats;
+    s->height = avl_height_fast(t);
+}
+#endif
+
+avl_height_fast(t)
+avltree_tree *t;
+{
+    return subtree_height(t->root);
 }
 
 /* Debug functions: */
@@ -499,14 +3515,20 @@ avltree_node *r;
         return 0;
     lh = avl_height(stream, t, r->child[0])+1;
     rh = avl_height(stream, t, r->child[1])+1;
-    if (r->bf != rh - lh || abs(r->bf) >= 2) {
+    if (AVL_BF(r) != rh - lh || abs(AVL_BF(r)) >= 2) {
         fprintf(stream, "Node ");
         if (t->stprint.print_fn)
-            t->stprint.print_fn(stream, r->key, r->value);
+            t->stprint.print_fn(stream, r->key, AVL_VALUE(r));
         else
             fprintf(stream, "%p", r);
-        fprintf(stream, " rh: %d lh: %d, BF -> %d\n", rh, lh, r->bf);
+        fprintf(stream, " rh: %d lh: %d, BF -> %d\n", rh, lh, AVL_BF(r));
+        exit(EXIT_FAILURE);
+    }
+#ifdef AVLTREE_SIZE
+    if (r->size != AVL_SIZE(r->child[0]) + AVL_SIZE(r->child[1]) + AVL_COUNT(r)) {
+        fprintf(stream, "Node %p size %d\n", r, r->size);
         exit(EXIT_FAILURE);
     }
+#endif
     return rh > lh? rh : lh;
 }
@@ -1,9 +1,20 @@
 /*
-    avltree.h - v2.0.0
+    avltree.h - v2.1.0
     AVL tree implementation in C.
     Copyright (C) 2025  João Manica  <joaoedisonmanica@gmail.com>
 
     History:
+        v2.1.0  Node allocators and slab pools, single descent insertion,
+                comparator counter (AVLTREE_STATS), iterative traversal,
+                cursors, bounds and range queries, order statistics
+                (AVLTREE_SIZE), bulk loading, set algebra,
+                split and join, typed trees (AVLTREE_DEFINE), compact
+                nodes (AVLTREE_COMPACT, AVLTREE_NO_VALUE), frozen snapshots,
+                SIMD batched lookups of int64_t keys, persistent trees,
+                parallel bulk operations, operation statistics
+                (avltree_stats) and probes, binary snapshots, wide
+                nodes (avltree_create_wide), multisets (AVLTREE_COUNT),
+                avltree_upsert(), range aggregates (AVLTREE_AGG_TYPE).
         v2.0.0  avl_diff(), avl_copy_keys(), flags parameter in avl_remove,
                 stream pointer parameter and separator string in printing
                 routines.
@@ -24,19 +35,136 @@
 #define AVLTREE_H
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 
 #define AVLTREE_FREE_NONE  00
 #define AVLTREE_FREE_KEY   01
 #define AVLTREE_FREE_VALUE 02
 #define AVLTREE_FREE_BOTH  03
 
+/* inplace of a tree that keeps one node per key with its number of
+   insertions; needs AVLTREE_COUNT, and is a plain inplace tree otherwise. */
+#define AVLTREE_MULTISET 2
+
+/* Set operations: which keys are kept, by the trees they are in. */
+#define AVLTREE_SET_TD        01
+#define AVLTREE_SET_TS        02
+#define AVLTREE_SET_BOTH      04
+#define AVLTREE_UNION         07
+#define AVLTREE_INTERSECTION  04
+#define AVLTREE_DIFFERENCE    01
+#define AVLTREE_SYMDIFF       03
+
+/* AVLTREE_COMPACT packs the balance factor into the low bits of the parent
+   pointer; AVLTREE_NO_VALUE drops the value for key-only trees. Node fields
+   other than child and key are read and written through the AVL_ macros. */
 typedef struct avltree_node {
+#ifdef AVLTREE_COMPACT
+    /* Parent pointer | (bf + 4). Nodes are at least 8-byte aligned. */
+    uintptr_t parent_bf;
+    struct avltree_node *child[2];
+#else
     short bf;
     struct avltree_node *parent, *child[2];
-    void *key, *value;
+#endif
+    void *key;
+#ifndef AVLTREE_NO_VALUE
+    void *value;
+#ifndef AVLTREE_COMPACT
     unsigned char has_value;
+#endif
+#endif
+#ifdef AVLTREE_COUNT
+    /* Occurrences of key. */
+    int count;
+#endif
+#ifdef AVLTREE_SIZE
+    /* Nodes in the subtree, or occurrences with AVLTREE_COUNT. */
+    int size;
+#endif
+#ifdef AVLTREE_AGG_TYPE
+    /* Aggregate of the subtree. */
+    AVLTREE_AGG_TYPE agg;
+#endif
 } avltree_node;
 
+#ifdef AVLTREE_COMPACT
+#define AVL_PARENT(N) ((avltree_node *)((N)->parent_bf & ~(uintptr_t)7))
+#define AVL_SET_PARENT(N, P) \
+    ((N)->parent_bf = (uintptr_t)(P) | ((N)->parent_bf & 7))
+#define AVL_BF(N) ((int)((N)->parent_bf & 7) - 4)
+#define AVL_SET_BF(N, BF) \
+    ((N)->parent_bf = ((N)->parent_bf & ~(uintptr_t)7) | (uintptr_t)((BF) + 4))
+#else
+#define AVL_PARENT(N) ((N)->parent)
+#define AVL_SET_PARENT(N, P) ((N)->parent = (P))
+#define AVL_BF(N) ((N)->bf)
+#define AVL_SET_BF(N, BF) ((N)->bf = (BF))
+#endif
+
+#if defined(AVLTREE_NO_VALUE)
+#define AVL_HAS_VALUE(N) 0
+#define AVL_VALUE(N) ((void *)NULL)
+#define AVL_SET_VALUE(N, V) ((void)(N), (void)(V))
+#elif defined(AVLTREE_COMPACT)
+#define AVL_HAS_VALUE(N) ((N)->value != NULL)
+#define AVL_VALUE(N) ((N)->value)
+#define AVL_SET_VALUE(N, V) ((N)->value = (V))
+#else
+#define AVL_HAS_VALUE(N) ((N)->has_value)
+#define AVL_VALUE(N) ((N)->value)
+#define AVL_SET_VALUE(N, V) \
+    ((N)->has_value = ((N)->value = (V)) != NULL)
+#endif
+
+#ifdef AVLTREE_COUNT
+#define AVL_COUNT(N) ((N)->count)
+#define AVL_SET_COUNT(N, C) ((N)->count = (C))
+#else
+#define AVL_COUNT(N) 1
+#define AVL_SET_COUNT(N, C) ((void)(N), (void)(C))
+#endif
+
+/* Node allocator. ctx is passed as the first argument of every callback. */
+typedef struct avltree_allocator {
+    void *(*alloc)(void *, size_t);
+    void (*free)(void *, void *);
+    /* Optional: releases every node at once. Only set it when the allocator
+       serves a single tree. */
+    void (*release)(void *);
+    void *ctx;
+} avltree_allocator;
+
+/* Slab allocator of fixed-size nodes with an intrusive free list. */
+typedef struct avltree_pool {
+    avltree_allocator allocator;
+    struct avltree_slab *slabs;
+    void *free_list;
+    unsigned char *next, *end;
+    size_t size, nperslab;
+} avltree_pool;
+
+#ifdef AVLTREE_STATS
+/* Counters kept by a tree when avltree.c is built with AVLTREE_STATS, which
+   then also fires USDT probes (avltree:rotation, avltree:retrace,
+   avltree:alloc, avltree:free) if <sys/sdt.h> is found. */
+typedef struct avltree_stats {
+    /* Calls to compar. */
+    unsigned long compar;
+    /* Searches from the root, and the nodes they went through. */
+    unsigned long lookups, visited;
+    /* Rotations while rebalancing; a double rotation counts once. */
+    unsigned long single_rotations, double_rotations;
+    /* Retraces after an insertion or removal, the nodes they went up, and
+       the most nodes in one. */
+    unsigned long retraces, retrace_steps, retrace_max;
+    unsigned long allocs, frees;
+    /* Only set by avltree_get_stats(). */
+    int height;
+} avltree_stats;
+#endif
+
 typedef struct {
     avltree_node *root;
     int nmemb;
@@ -46,10 +174,44 @@ typedef struct {
         void (*print_fn)(FILE*, void *, void *);
         char *separator;
     } stprint;
-    /* If true, the insertion replaces values with the same key */
+    /* If true, the insertion replaces values with the same key; with
+       AVLTREE_MULTISET it also counts it. */
     unsigned char inplace;
+    /* NULL uses malloc() and free() */
+    avltree_allocator *alloc;
+    /* alloc is a pool created by the tree itself */
+    unsigned char own_alloc;
+    /* A B-tree of wide nodes, from avltree_create_wide(); root is unused. */
+    unsigned char wide;
+    struct avltree_wide *wroot;
+#ifdef AVLTREE_STATS
+    avltree_stats stats;
+#endif
+#ifdef AVLTREE_AGG_TYPE
+    /* From avltree_set_aggregate(); unused while combine is NULL. */
+    struct {
+        AVLTREE_AGG_TYPE (*lift)(avltree_node *);
+        AVLTREE_AGG_TYPE (*combine)(AVLTREE_AGG_TYPE, AVLTREE_AGG_TYPE);
+        AVLTREE_AGG_TYPE identity;
+    } agg;
+#endif
 } avltree_tree;
 
+#ifdef AVLTREE_STATS
+void avltree_stats_reset(avltree_tree *t);
+/* Copies the counters of t into s, with its current height. */
+void avltree_get_stats(avltree_tree *t, avltree_stats *s);
+#define AVLTREE_STATS_INIT(T) avltree_stats_reset(&(T))
+#else
+#define AVLTREE_STATS_INIT(T) ((void)0)
+#endif
+
+#ifdef AVLTREE_AGG_TYPE
+#define AVLTREE_AGG_INIT(T) ((T).agg.combine = NULL)
+#else
+#define AVLTREE_AGG_INIT(T) ((void)0)
+#endif
+
 
 #define avltree_create(T, INPLACE, CMP_FN, PRINT_FN, SEPARATOR) \
     do { \
@@ -59,8 +221,37 @@ typedef struct {
          T.compar = CMP_FN; \
          T.stprint.print_fn = PRINT_FN; \
          T.stprint.separator = SEPARATOR; \
+         T.alloc = NULL; \
+         T.own_alloc = 0; \
+         T.wide = 0; \
+         T.wroot = NULL; \
+         AVLTREE_STATS_INIT(T); \
+         AVLTREE_AGG_INIT(T); \
+    } while (0)
+
+/* A tree of nodes holding up to 2 * AVLTREE_WIDE_T - 1 sorted keys each, for
+   fewer levels and cache misses than one key per node. Only avltree_insert(),
+   avltree_remove(), avltree_lookup(), avltree_destroy() and avltree_empty()
+   work on it, with the same semantics, except that avltree_insert() returns
+   NULL. Nodes always come from malloc. */
+#define avltree_create_wide(T, INPLACE, CMP_FN) \
+    do { \
+         avltree_create(T, INPLACE, CMP_FN, NULL, NULL); \
+         T.wide = 1; \
     } while (0)
 
+#define avltree_set_allocator(T, ALLOC) \
+    ((T).alloc = (ALLOC))
+#define avltree_use_pool(T, POOL) \
+    ((T).alloc = &(POOL).allocator)
+
+/* SHARED pools may serve many trees, but cannot release them in bulk. */
+void avltree_pool_init(avltree_pool *p, size_t size, size_t nperslab, unsigned char shared);
+void avltree_pool_destroy(avltree_pool *p);
+void avltree_pool_reserve(avltree_pool *p, size_t n);
+void *avltree_pool_alloc(void *pool, size_t size);
+void avltree_pool_free(void *pool, void *ptr);
+
 void avl_destroy(avltree_tree *t, avltree_node *r);
 #define avltree_destroy(T) \
     do { \
@@ -79,7 +270,8 @@ void avl_destroy(avltree_tree *t, avltree_node *r);
         } \
     } while (0)
 
-/* Does not release memory in key and value. */
+/* Does not release memory in key and value. With an allocator that can release
+   in bulk, emptying the whole tree costs O(number of slabs). */
 void avl_empty(avltree_tree *t, avltree_node *r);
 #define avltree_empty(T) \
     avl_empty(&(T), (T).root)
@@ -98,6 +290,51 @@ void avl_diff(avltree_tree *td, avltree_tree *ts, avltree_node *r, unsigned char
 #define avltree_diff_ptr(TD, TS, FLAGS) \
     avl_diff(TD, TS, (TS)->root, FLAGS)
 
+/* td = td OP ts in O(m + n). With MOVE, nodes are moved from ts, which ends
+   empty; otherwise ts is kept and its keys are shared as in
+   avl_copy_keys(). Nodes left out are freed with FLAGS. */
+void avl_set_op(avltree_tree *td, avltree_tree *ts, unsigned char op, unsigned char move, unsigned char flags);
+#define avltree_union(TD, TS, MOVE, FLAGS) \
+    avl_set_op(&(TD), &(TS), AVLTREE_UNION, MOVE, FLAGS)
+#define avltree_union_ptr(TD, TS, MOVE, FLAGS) \
+    avl_set_op(TD, TS, AVLTREE_UNION, MOVE, FLAGS)
+#define avltree_intersection(TD, TS, MOVE, FLAGS) \
+    avl_set_op(&(TD), &(TS), AVLTREE_INTERSECTION, MOVE, FLAGS)
+#define avltree_intersection_ptr(TD, TS, MOVE, FLAGS) \
+    avl_set_op(TD, TS, AVLTREE_INTERSECTION, MOVE, FLAGS)
+#define avltree_difference(TD, TS, MOVE, FLAGS) \
+    avl_set_op(&(TD), &(TS), AVLTREE_DIFFERENCE, MOVE, FLAGS)
+#define avltree_difference_ptr(TD, TS, MOVE, FLAGS) \
+    avl_set_op(TD, TS, AVLTREE_DIFFERENCE, MOVE, FLAGS)
+#define avltree_symdiff(TD, TS, MOVE, FLAGS) \
+    avl_set_op(&(TD), &(TS), AVLTREE_SYMDIFF, MOVE, FLAGS)
+#define avltree_symdiff_ptr(TD, TS, MOVE, FLAGS) \
+    avl_set_op(TD, TS, AVLTREE_SYMDIFF, MOVE, FLAGS)
+
+/* Returns the key found equal to KEY and stores its value, or returns NULL,
+   on AVL and wide trees alike. VALUEP may be NULL. */
+void *avltree_lookup(avltree_tree *t, void *key, void **valuep);
+
+/* Moves the keys less than KEY to left and the others to right, in O(log n)
+   plus, without AVLTREE_SIZE or with AVLTREE_COUNT, counting the nodes of
+   left. t ends empty; left or right may be t itself. Both keep the allocator
+   of t, which therefore cannot be one that releases in bulk. */
+void avltree_split(avltree_tree *t, void *key, avltree_tree *left, avltree_tree *right);
+/* As avltree_split(), in O(log n) with any options when the caller knows
+   NLEFT, the number of keys less than KEY; a negative NLEFT counts them. */
+void avl_split(avltree_tree *t, void *key, avltree_tree *left, avltree_tree *right, int nleft);
+/* Moves every node of right into left, in O(log n). All keys in left must be
+   less than KEY, and KEY less than all keys in right. A NULL KEY joins the
+   trees without a new node. */
+void avltree_join(avltree_tree *left, void *key, void *value, avltree_tree *right);
+/* Removes the keys in [LO, HI), a NULL bound is open, in O(log n) plus the
+   nodes freed. Returns how many were removed. */
+int avl_delete_range(avltree_tree *t, void *lo, void *hi, unsigned char flags);
+#define avltree_delete_range(T, LO, HI, FLAGS) \
+    avl_delete_range(&T, LO, HI, FLAGS)
+#define avltree_delete_range_ptr(T, LO, HI, FLAGS) \
+    avl_delete_range(T, LO, HI, FLAGS)
+
 avltree_node *avl_find_max(avltree_tree *t, avltree_node *r);
 #define avltree_find_max(T) \
     avl_find_max(&T, T.root)
@@ -111,12 +348,132 @@ avltree_node *avl_find_node(avltree_tree *t, avltree_node *r, void *key, avltree
 #define avltree_find_node_ptr(T, KEY) \
     avl_find_node(T, T->root, KEY, NULL)
 
+/* First node with key >= KEY, first with key > KEY, last with key <= KEY. */
+avltree_node *avl_lower_bound(avltree_tree *t, avltree_node *r, void *key);
+#define avltree_lower_bound(T, KEY) \
+    avl_lower_bound(&T, T.root, KEY)
+#define avltree_lower_bound_ptr(T, KEY) \
+    avl_lower_bound(T, T->root, KEY)
+#define avltree_ceiling(T, KEY) \
+    avl_lower_bound(&T, T.root, KEY)
+avltree_node *avl_upper_bound(avltree_tree *t, avltree_node *r, void *key);
+#define avltree_upper_bound(T, KEY) \
+    avl_upper_bound(&T, T.root, KEY)
+#define avltree_upper_bound_ptr(T, KEY) \
+    avl_upper_bound(T, T->root, KEY)
+avltree_node *avl_floor(avltree_tree *t, avltree_node *r, void *key);
+#define avltree_floor(T, KEY) \
+    avl_floor(&T, T.root, KEY)
+#define avltree_floor_ptr(T, KEY) \
+    avl_floor(T, T->root, KEY)
+
+/* Visits the nodes with LO <= key < HI in order; a NULL bound is open. Stops
+   when visit returns nonzero and returns that value. */
+int avl_range(avltree_tree *t, void *lo, void *hi, int (*visit)(void *, avltree_node *), void *ctx);
+#define avltree_range(T, LO, HI, VISIT, CTX) \
+    avl_range(&T, LO, HI, VISIT, CTX)
+#define avltree_range_ptr(T, LO, HI, VISIT, CTX) \
+    avl_range(T, LO, HI, VISIT, CTX)
+
+#ifdef AVLTREE_COUNT
+/* On AVLTREE_MULTISET trees. The functions below that count keys count
+   occurrences instead; nmemb, iteration and the other functions still see
+   one node per key, with AVL_COUNT() occurrences. */
+
+/* Occurrences of KEY, or 0. */
+int avltree_count(avltree_tree *t, void *key);
+/* Adds DELTA occurrences to n, and removes it with FLAGS once none is left.
+   Returns the occurrences left. */
+int avl_add_count(avltree_tree *t, avltree_node *n, int delta, unsigned char flags);
+#define avltree_increment(T, N) \
+    avl_add_count(&T, N, 1, AVLTREE_FREE_NONE)
+#define avltree_increment_ptr(T, N) \
+    avl_add_count(T, N, 1, AVLTREE_FREE_NONE)
+#define avltree_decrement(T, N, FLAGS) \
+    avl_add_count(&T, N, -1, FLAGS)
+#define avltree_decrement_ptr(T, N, FLAGS) \
+    avl_add_count(T, N, -1, FLAGS)
+/* Removes one occurrence of KEY; as avltree_remove() otherwise. */
+int avltree_remove_one(avltree_tree *t, void *key, unsigned char flags);
+/* Call when an insertion finds n in place, to count it on multisets. */
+#define AVL_INPLACE_HIT(T, N) \
+    ((T)->inplace == AVLTREE_MULTISET? (void)avl_add_count(T, N, 1, AVLTREE_FREE_NONE) : (void)0)
+#else
+#define AVL_INPLACE_HIT(T, N) ((void)0)
+#endif
+
+#ifdef AVLTREE_SIZE
+/* K-th smallest node, from 0. */
+avltree_node *avl_select(avltree_tree *t, int k);
+#define avltree_select(T, K) \
+    avl_select(&T, K)
+#define avltree_select_ptr(T, K) \
+    avl_select(T, K)
+/* Number of keys less than KEY. */
+int avl_rank(avltree_tree *t, void *key);
+#define avltree_rank(T, KEY) \
+    avl_rank(&T, KEY)
+#define avltree_rank_ptr(T, KEY) \
+    avl_rank(T, KEY)
+/* Number of keys in [LO, HI); a NULL bound is open. */
+int avl_count_range(avltree_tree *t, void *lo, void *hi);
+#define avltree_count_range(T, LO, HI) \
+    avl_count_range(&T, LO, HI)
+#define avltree_count_range_ptr(T, LO, HI) \
+    avl_count_range(T, LO, HI)
+#endif
+
+#ifdef AVLTREE_AGG_TYPE
+/* Every node keeps combine() over the lift() of the nodes of its subtree,
+   in key order. combine must be associative with IDENTITY as its identity;
+   lift sees the whole node, with its value and AVL_COUNT(). Setting them
+   recomputes the tree in O(n). Not for wide trees. */
+void avltree_set_aggregate(avltree_tree *t, AVLTREE_AGG_TYPE (*lift)(avltree_node *), AVLTREE_AGG_TYPE (*combine)(AVLTREE_AGG_TYPE, AVLTREE_AGG_TYPE), AVLTREE_AGG_TYPE identity);
+/* Aggregate of the keys in [LO, HI), a NULL bound is open, in O(log n). */
+AVLTREE_AGG_TYPE avl_range_aggregate(avltree_tree *t, void *lo, void *hi);
+#define avltree_range_aggregate(T, LO, HI) \
+    avl_range_aggregate(&T, LO, HI)
+#define avltree_range_aggregate_ptr(T, LO, HI) \
+    avl_range_aggregate(T, LO, HI)
+/* Call after changing the value of n in place. */
+void avl_update_node(avltree_tree *t, avltree_node *n);
+#define AVL_VALUE_CHANGED(T, N) avl_update_node(T, N)
+#else
+#define AVL_VALUE_CHANGED(T, N) ((void)0)
+#endif
+
 avltree_node *avltree_insert(avltree_tree *t, void *key, void *value);
 #define avltree_insert_key(T, KEY) \
     avltree_insert(&T, KEY, NULL)
 #define avltree_insert_key_ptr(T, KEY) \
     avltree_insert(T, KEY, NULL)
 
+/* Searches for PROBE, which the tree never keeps, and on a hit calls
+   update_value(ctx, node), which may change the value in place; nothing is
+   freed. On a miss make_key(ctx, probe, &value) returns the key for a new
+   node, owned as in avltree_insert(), and may set its value, NULL before
+   the call. Returns the node, or NULL if make_key does. update_value may be
+   NULL. With AVLTREE_MULTISET a hit also counts. Not for wide trees. */
+avltree_node *avltree_upsert(avltree_tree *t, void *probe, void *(*make_key)(void *, void *, void **), void (*update_value)(void *, avltree_node *), void *ctx);
+
+/* Builds a balanced tree from N sorted keys in O(n); T must be empty. With a
+   STRIDE, key i is KEYS + i*STRIDE and stays owned by the caller, so the tree
+   must be released with avltree_empty(). Otherwise KEYS is an array of N key
+   pointers owned by the tree as in avltree_insert(). VALUES may be NULL.
+   Without an allocator, the nodes are allocated in a single block. */
+int avltree_build_sorted(avltree_tree *t, void *keys, void **values, int n, size_t stride);
+/* Same result as inserting or removing the N keys in turn. The batch is
+   sorted, in O(n) if it already is, and each key is searched from the node
+   of the previous one. Into an empty tree, the batch is bulk loaded. Not
+   for wide trees. */
+void avltree_insert_batch(avltree_tree *t, void **keys, void **values, int n);
+/* Returns how many keys were found and removed. */
+int avltree_remove_batch(avltree_tree *t, void **keys, int n, unsigned char flags);
+
+/* For nodes that embed an avltree_node, as in AVLTREE_DEFINE. */
+void *avl_alloc_node(avltree_tree *t, size_t size);
+void avl_link_node(avltree_tree *t, avltree_node *parent, unsigned char side, avltree_node *n);
+
 void avl_remove(avltree_tree *t, avltree_node *z, unsigned char flags);
 
 int avltree_remove(avltree_tree *t, void *key, unsigned char flags);
@@ -126,6 +483,9 @@ int avltree_remove(avltree_tree *t, void *key, unsigned char flags);
     avltree_remove(T, KEY, FLAGS)
 
 int avl_height(FILE *stream, avltree_tree *t, avltree_node *r);
+/* The height of t in O(log n), down the taller side of each node; unlike
+   avl_height() it checks nothing. */
+int avl_height_fast(avltree_tree *t);
 #define avltree_height(STREAM, T) \
     avl_height(STREAM, &T, T.root)
 
@@ -147,4 +507,317 @@ void avl_keys_to_array(avltree_tree *t, avltree_node *r, unsigned char *arr, siz
 #define avltree_keys_to_array(T, ARR, SIZE, NMEMB, CAP) \
     avl_keys_to_array(&T, T.root, ARR, SIZE, NMEMB, CAP)
 
+/* In-order neighbours of a node, or NULL. */
+avltree_node *avl_next(avltree_node *n);
+avltree_node *avl_prev(avltree_node *n);
+
+/* In-order cursor. node is NULL past either end. */
+typedef struct {
+    avltree_tree *t;
+    avltree_node *node;
+} avltree_cursor;
+
+avltree_node *avltree_cursor_first(avltree_cursor *c, avltree_tree *t);
+avltree_node *avltree_cursor_last(avltree_cursor *c, avltree_tree *t);
+/* Moves to the first node with key greater than or equal to KEY. */
+avltree_node *avltree_cursor_seek(avltree_cursor *c, avltree_tree *t, void *key);
+avltree_node *avltree_cursor_next(avltree_cursor *c);
+avltree_node *avltree_cursor_prev(avltree_cursor *c);
+/* Removes the current node and moves to the next one. */
+avltree_node *avltree_cursor_remove(avltree_cursor *c, unsigned char flags);
+
+/* Read-only snapshot in Eytzinger (breadth-first) order: the children of slot
+   i are 2i and 2i + 1, so the top levels share cache lines and the next ones
+   can be prefetched. Slots start at 1; 0 means none. With a key_size, the
+   keys are copied into block and compared in place; otherwise keys holds the
+   key pointers of the tree, which must outlive the snapshot. */
+typedef struct {
+    int nmemb;
+    int (*compar)(const void *, const void *);
+    void **keys;
+    unsigned char *block;
+    size_t key_size;
+    void **values;
+} avltree_frozen;
+
+#define AVL_FROZEN_KEY(F, I) \
+    ((F)->key_size? (void *)((F)->block + (size_t)(I) * (F)->key_size) : (F)->keys[I])
+#ifdef AVLTREE_NO_VALUE
+#define AVL_FROZEN_VALUE(F, I) ((void *)NULL)
+#else
+#define AVL_FROZEN_VALUE(F, I) ((F)->values[I])
+#endif
+
+/* Returns nonzero if out of memory. t is left unchanged. */
+int avltree_freeze(avltree_tree *t, avltree_frozen *f, size_t key_size);
+void avltree_frozen_destroy(avltree_frozen *f);
+/* Slot of the first key >= KEY; slot of a key equal to KEY. */
+int avltree_frozen_lower_bound(avltree_frozen *f, void *key);
+int avltree_frozen_find(avltree_frozen *f, void *key);
+/* In-order neighbours of a slot. */
+int avltree_frozen_first(avltree_frozen *f);
+int avltree_frozen_next(avltree_frozen *f, int i);
+/* As avl_range(), visit gets ctx, key and value. */
+int avltree_frozen_range(avltree_frozen *f, void *lo, void *hi, int (*visit)(void *, void *, void *), void *ctx);
+
+/* Snapshot of a tree whose keys point to int64_t, as an implicit B-tree of
+   AVLTREE_B64 keys per 64 byte block: the children of block b are
+   b * (AVLTREE_B64 + 1) + 1 + i. A block is searched with one SIMD compare
+   per 4 keys (AVX2), 2 keys (SSE4.2) or a scalar loop, chosen at run time.
+   Lookups return the index of the key in sorted order, or -1; values[i] is
+   the value of the i-th key. */
+#define AVLTREE_B64 8
+
+typedef struct {
+    int nmemb, nblocks;
+    int64_t *keys;
+    /* Sorted index of every slot of keys; nmemb for the padding. */
+    int *rank;
+    void **values;
+    void *mem;
+} avltree_frozen64;
+
+int avltree_freeze64(avltree_tree *t, avltree_frozen64 *f);
+void avltree_frozen64_destroy(avltree_frozen64 *f);
+/* Index of the first key >= KEY, nmemb if none. */
+int avltree_frozen64_lower_bound(avltree_frozen64 *f, int64_t key);
+int avltree_frozen64_find(avltree_frozen64 *f, int64_t key);
+/* out[i] = avltree_frozen64_find(f, keys[i]). Searches are interleaved so
+   that the cache misses of many keys overlap. */
+void avltree_frozen64_find_batch(avltree_frozen64 *f, const int64_t *keys, int n, int *out);
+
+/*
+    Binary snapshots: a header, then one avltree_record per node in pre-order,
+    then the bytes of keys and values, each 8-byte aligned. The left child of
+    a record is the next one, so the shape of the tree is kept and loading
+    needs no rebalancing. Offsets are from the start of the file, and
+    integers are in host byte order. AVLTREE_COUNT occurrences are not
+    saved; every key loads once.
+*/
+#define AVLTREE_FILE_MAGIC "AVLTREE"
+#define AVLTREE_FILE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version, height;
+    uint64_t nmemb;
+} avltree_file_header;
+
+typedef struct {
+    /* Offsets of the key and value bytes; value is 0 if there is none. */
+    uint64_t key, value;
+    uint32_t key_len, value_len;
+    /* Record of the right child, or 0. */
+    uint32_t right;
+    int8_t bf;
+    /* Whether the next record is the left child. */
+    uint8_t left;
+    uint8_t pad[2];
+} avltree_record;
+
+/* Converts keys and values to bytes and back. The bytes returned by save_
+   callbacks must stay valid until the next call. Values are not saved when
+   save_value is NULL, and load as NULL when load_value is. */
+typedef struct {
+    const void *(*save_key)(void *, void *, size_t *);
+    const void *(*save_value)(void *, void *, size_t *);
+    void *(*load_key)(void *, const void *, size_t);
+    void *(*load_value)(void *, const void *, size_t);
+    void *ctx;
+} avltree_codec;
+
+/* Return nonzero on a write or read error, or on a file that is not a
+   snapshot. Saving only needs a sequential stream. t must be empty before
+   avltree_load(); its nodes then come from a single block. The records are
+   checked to form a balanced tree inside the file; the order of the keys
+   is not. */
+int avltree_save(avltree_tree *t, FILE *stream, avltree_codec *c);
+int avltree_load(avltree_tree *t, FILE *stream, avltree_codec *c);
+
+/* A snapshot mapped read-only: lookups compare saved key bytes in place,
+   with a COMPAR on them, and allocate nothing. Lookups return a record, or
+   -1. */
+typedef struct {
+    int nmemb;
+    int (*compar)(const void *, const void *);
+    unsigned char *base;
+    size_t size;
+    avltree_record *rec;
+} avltree_mapped;
+
+#define AVL_MAPPED_KEY(M, I) ((void *)((M)->base + (M)->rec[I].key))
+#define AVL_MAPPED_VALUE(M, I) \
+    ((M)->rec[I].value? (void *)((M)->base + (M)->rec[I].value) : NULL)
+
+int avltree_map(avltree_mapped *m, const char *path, int (*compar)(const void *, const void *));
+void avltree_unmap(avltree_mapped *m);
+int avltree_mapped_find(avltree_mapped *m, void *key);
+int avltree_mapped_lower_bound(avltree_mapped *m, void *key);
+
+/* Fork-join executor for the avltree_par_ routines; avltree_workers in
+   avltree_mt.h provides one. spawn() may run fn(arg) on another thread, and
+   returns what sync() then waits for. */
+typedef struct avltree_exec {
+    void *(*spawn)(void *, void (*)(void *), void *);
+    void (*sync)(void *, void *);
+    void *ctx;
+} avltree_exec;
+
+/* Parallel versions of bulk operations, forking on subtrees until they are
+   small. The allocator of the tree need not be thread safe: nodes are
+   allocated, and freed through it, by the calling thread. */
+int avltree_par_build(avltree_exec *ex, avltree_tree *t, void *keys, void **values, int n, size_t stride);
+/* As avl_set_op() with MOVE, for trees without duplicate keys. */
+void avltree_par_set_op(avltree_exec *ex, avltree_tree *td, avltree_tree *ts, unsigned char op, unsigned char flags);
+/* Calls visit(ctx, node) on every node, in no order and from any thread. */
+void avltree_par_visit(avltree_exec *ex, avltree_tree *t, void (*visit)(void *, avltree_node *), void *ctx);
+/* Empties t, freeing keys and values as FLAGS says. */
+void avltree_par_free(avltree_exec *ex, avltree_tree *t, unsigned char flags);
+
+/*
+    Persistent trees: every insertion or removal makes a new version that
+    copies the path it changed and shares the rest with the version it came
+    from. Nodes are reference counted and never change once built, so a
+    snapshot is O(1) and versions can be read without locks. Keys and values
+    stay owned by the caller. Taking a snapshot of a version and replacing
+    that same version must not run concurrently; anything else may.
+*/
+typedef struct avltree_pnode {
+    struct avltree_pnode *child[2];
+    void *key, *value;
+    int refs, height;
+} avltree_pnode;
+
+typedef struct {
+    avltree_pnode *root;
+    int nmemb;
+    int (*compar)(const void *, const void *);
+    /* If true, the insertion replaces values with the same key */
+    unsigned char inplace;
+} avltree_ptree;
+
+#define avltree_pcreate(T, INPLACE, CMP_FN) \
+    do { \
+         (T).root = NULL; \
+         (T).nmemb = 0; \
+         (T).inplace = INPLACE; \
+         (T).compar = CMP_FN; \
+    } while (0)
+
+/* DST gets the new version. It may be SRC, whose old version is then
+   released; otherwise it is overwritten. */
+void avltree_psnapshot(avltree_ptree *dst, avltree_ptree *src);
+void avltree_pinsert(avltree_ptree *dst, avltree_ptree *src, void *key, void *value);
+/* Returns 1 if KEY is not in SRC; DST is then left alone. */
+int avltree_premove(avltree_ptree *dst, avltree_ptree *src, void *key);
+void avltree_prelease(avltree_ptree *t);
+avltree_pnode *avltree_pfind(avltree_ptree *t, void *key);
+/* As avltree_frozen_range(). */
+int avltree_prange(avltree_ptree *t, void *lo, void *hi, int (*visit)(void *, void *, void *), void *ctx);
+
+/*
+    Typed trees: AVLTREE_DEFINE(NAME, KEY_T, CMP) defines NAME_node, which
+    stores a KEY_T inside the node, and functions that compare keys inline
+    with the expression CMP(a, b) on two KEY_T values:
+
+        AVLTREE_DEFINE(i64, long long, AVLTREE_CMP)
+
+        avltree_tree t;
+        i64_create(&t, 1);
+        i64_insert(&t, 42, NULL);
+        i64_find(&t, 42);
+        i64_destroy(&t, AVLTREE_FREE_VALUE);
+
+    node.key points to the embedded key, so the functions that only read or
+    relink nodes (cursors, bounds, ranges, printing, split, avl_remove) also
+    work on these trees. Nodes must be created by NAME_insert(), and the key
+    is never freed.
+*/
+#define AVLTREE_CMP(A, B) (((A) > (B)) - ((A) < (B)))
+
+#define AVLTREE_DEFINE(NAME, KEY_T, CMP) \
+    typedef struct NAME##_node { \
+        avltree_node node; \
+        KEY_T key; \
+    } NAME##_node; \
+    \
+    static inline int NAME##_compar(const void *a, const void *b) \
+    { \
+        return CMP(*(const KEY_T *)a, *(const KEY_T *)b); \
+    } \
+    \
+    static inline void NAME##_create(avltree_tree *t, unsigned char inplace) \
+    { \
+        avltree_create((*t), inplace, NAME##_compar, NULL, NULL); \
+    } \
+    \
+    static inline NAME##_node *NAME##_find(avltree_tree *t, KEY_T key) \
+    { \
+        avltree_node *r; \
+        int cmp; \
+        for (r = t->root; r; r = r->child[cmp > 0]) \
+            if (!(cmp = CMP(key, ((NAME##_node *)r)->key))) \
+                return (NAME##_node *)r; \
+        return NULL; \
+    } \
+    \
+    static inline NAME##_node *NAME##_lower_bound(avltree_tree *t, KEY_T key) \
+    { \
+        avltree_node *r, *best; \
+        for (best = NULL, r = t->root; r; ) \
+            if (CMP(key, ((NAME##_node *)r)->key) <= 0) { \
+                best = r; \
+                r = r->child[0]; \
+            } else \
+                r = r->child[1]; \
+        return (NAME##_node *)best; \
+    } \
+    \
+    static inline NAME##_node *NAME##_insert(avltree_tree *t, KEY_T key, void *value) \
+    { \
+        avltree_node *r, *parent; \
+        NAME##_node *new; \
+        int cmp, gt; \
+        for (parent = NULL, gt = 0, r = t->root; r; r = r->child[gt]) { \
+            cmp = CMP(key, ((NAME##_node *)r)->key); \
+            if (!cmp && t->inplace) { \
+                if (AVL_HAS_VALUE(r)) \
+                    free(AVL_VALUE(r)); \
+                AVL_SET_VALUE(r, value); \
+                AVL_VALUE_CHANGED(t, r); \
+                AVL_INPLACE_HIT(t, r); \
+                return (NAME##_node *)r; \
+            } \
+            parent = r; \
+            gt = cmp > 0; \
+        } \
+        new = avl_alloc_node(t, sizeof(NAME##_node)); \
+        new->key = key; \
+        new->node.key = &new->key; \
+        AVL_SET_VALUE(&new->node, value); \
+        avl_link_node(t, parent, gt, &new->node); \
+        return new; \
+    } \
+    \
+    static inline int NAME##_remove(avltree_tree *t, KEY_T key, unsigned char flags) \
+    { \
+        NAME##_node *n; \
+        if (!(n = NAME##_find(t, key))) \
+            return 1; \
+        avl_remove(t, &n->node, flags & AVLTREE_FREE_VALUE); \
+        return 0; \
+    } \
+    \
+    static inline void NAME##_destroy(avltree_tree *t, unsigned char flags) \
+    { \
+        avltree_node *r; \
+        if (flags & AVLTREE_FREE_VALUE) \
+            for (r = avl_find_min(t, t->root); r; r = avl_next(r)) \
+                if (AVL_HAS_VALUE(r)) \
+                    free(AVL_VALUE(r)); \
+        avl_empty(t, t->root); \
+        t->root = NULL; \
+        t->nmemb = 0; \
+    }
+
 #endif
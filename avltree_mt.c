@@ -0,0 +1,973 @@
+/*
+    avltree_mt.c
+    Concurrent AVL tree on top of avltree.
+    Copyright (C) 2025  João Manica  <joaoedisonmanica@gmail.com>
+
+    avltree_mt.c is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+    more details.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "avltree_mt.h"
+
+/* Optimistic searches before a reader falls back to the lock. */
+#define AVL_MT_RETRIES 16
+/* A search longer than any path of a consistent tree saw a rotation. */
+#define AVL_MT_MAX_STEPS 128
+
+/* Readers load the root, links, keys and values that writers store with
+   AVL_LINK() or STORE(), and see what they point to complete. */
+#define LOAD(X) __atomic_load_n(&(X), __ATOMIC_ACQUIRE)
+#define STORE(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+
+#if defined(AVLTREE_NO_VALUE)
+#define LOAD_VALUE(N) ((void *)NULL)
+#define STORE_VALUE(N, V) AVL_SET_VALUE(N, V)
+#elif defined(AVLTREE_COMPACT)
+#define LOAD_VALUE(N) LOAD((N)->value)
+#define STORE_VALUE(N, V) STORE((N)->value, V)
+#else
+#define LOAD_VALUE(N) LOAD((N)->value)
+#define STORE_VALUE(N, V) (STORE((N)->value, V), (N)->has_value = (V) != NULL)
+#endif
+
+/* Epochs: */
+
+static void retire(t, ptr)
+avltree_mt *t;
+void *ptr;
+{
+    avltree_mt_limbo *l;
+    void **p;
+
+    l = &t->limbo[t->epoch % 3];
+    if (l->n == l->cap) {
+        if (!(p = realloc(l->ptr, sizeof(void *) * (l->cap? 2 * l->cap : 64))))
+            /* Leaks rather than free under a reader. */
+            return;
+        l->ptr = p;
+        l->cap = l->cap? 2 * l->cap : 64;
+    }
+    l->ptr[l->n++] = ptr;
+}
+
+static void empty_limbo(l)
+avltree_mt_limbo *l;
+{
+    size_t i;
+
+    for (i=0; i < l->n; i++)
+        free(l->ptr[i]);
+    l->n = 0;
+}
+
+/* Moves to the next epoch once every active reader is in the current one,
+   and frees what was retired two epochs ago: no reader can still see it. */
+static void try_advance(t)
+avltree_mt *t;
+{
+    avltree_mt_reader *r;
+    unsigned long st;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r = t->readers; r; r = r->next) {
+        st = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+        if (st & 1 && st >> 1 != t->epoch)
+            return;
+    }
+    __atomic_store_n(&t->epoch, t->epoch + 1, __ATOMIC_RELEASE);
+    empty_limbo(&t->limbo[t->epoch % 3]);
+}
+
+static void *node_alloc(ctx, size)
+void *ctx;
+size_t size;
+{
+    return malloc(size);
+}
+
+static void node_free(ctx, ptr)
+void *ctx, *ptr;
+{
+    retire((avltree_mt *)ctx, ptr);
+}
+
+void avltree_mt_init(t, inplace, compar)
+avltree_mt *t;
+unsigned char inplace;
+int (*compar)(const void *, const void *);
+{
+    int i;
+
+    avltree_create(t->t, inplace, compar, NULL, NULL);
+    t->alloc.alloc = node_alloc;
+    t->alloc.free = node_free;
+    t->alloc.release = NULL;
+    t->alloc.ctx = t;
+    avltree_set_allocator(t->t, &t->alloc);
+    pthread_mutex_init(&t->lock, NULL);
+    t->seq = 0;
+    t->epoch = 0;
+    t->readers = NULL;
+    for (i=0; i < 3; i++) {
+        t->limbo[i].ptr = NULL;
+        t->limbo[i].n = t->limbo[i].cap = 0;
+    }
+}
+
+void avltree_mt_destroy(t)
+avltree_mt *t;
+{
+    int i;
+
+    avltree_destroy(t->t);
+    for (i=0; i < 3; i++) {
+        empty_limbo(&t->limbo[i]);
+        free(t->limbo[i].ptr);
+    }
+    pthread_mutex_destroy(&t->lock);
+}
+
+void avltree_mt_reader_init(t, r)
+avltree_mt *t;
+avltree_mt_reader *r;
+{
+    r->state = 0;
+    pthread_mutex_lock(&t->lock);
+    r->next = t->readers;
+    t->readers = r;
+    pthread_mutex_unlock(&t->lock);
+}
+
+void avltree_mt_reader_destroy(t, r)
+avltree_mt *t;
+avltree_mt_reader *r;
+{
+    avltree_mt_reader **p;
+
+    pthread_mutex_lock(&t->lock);
+    for (p = &t->readers; *p != r; p = &(*p)->next)
+        ;
+    *p = r->next;
+    pthread_mutex_unlock(&t->lock);
+}
+
+void avltree_mt_enter(t, r)
+avltree_mt *t;
+avltree_mt_reader *r;
+{
+    __atomic_store_n(&r->state, __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE) << 1 | 1,
+                     __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void avltree_mt_leave(t, r)
+avltree_mt *t;
+avltree_mt_reader *r;
+{
+    __atomic_store_n(&r->state, r->state & ~1UL, __ATOMIC_RELEASE);
+}
+
+/* Readers: */
+
+/* One descent, as avl_find_node() or avl_lower_bound(). Returns -1 if a
+   writer ran meanwhile. */
+static search(t, key, lower, keyp, valuep)
+avltree_mt *t;
+void *key, **keyp, **valuep;
+unsigned char lower;
+{
+    avltree_node *n, *best;
+    unsigned long seq;
+    void *k, *v;
+    int cmp, steps;
+
+    seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return -1;
+    best = NULL;
+    for (n = LOAD(t->t.root), steps = 0; n && steps < AVL_MT_MAX_STEPS; steps++) {
+        cmp = t->t.compar(key, LOAD(n->key));
+        if (!cmp && !lower) {
+            best = n;
+            break;
+        }
+        if (cmp <= 0) {
+            if (lower)
+                best = n;
+            n = LOAD(n->child[0]);
+        } else
+            n = LOAD(n->child[1]);
+    }
+    if (best) {
+        k = LOAD(best->key);
+        v = LOAD_VALUE(best);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (steps == AVL_MT_MAX_STEPS || __atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq)
+        return -1;
+    if (!best)
+        return 0;
+    if (keyp)
+        *keyp = k;
+    if (valuep)
+        *valuep = v;
+    return 1;
+}
+
+static lookup(t, key, lower, keyp, valuep)
+avltree_mt *t;
+void *key, **keyp, **valuep;
+unsigned char lower;
+{
+    int i, ret;
+
+    for (i=0; i < AVL_MT_RETRIES; i++)
+        if ((ret = search(t, key, lower, keyp, valuep)) >= 0)
+            return ret;
+    /* Writers keep interfering. */
+    pthread_mutex_lock(&t->lock);
+    ret = search(t, key, lower, keyp, valuep);
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+avltree_mt_find(t, key, keyp, valuep)
+avltree_mt *t;
+void *key, **keyp, **valuep;
+{
+    return lookup(t, key, 0, keyp, valuep);
+}
+
+avltree_mt_lower_bound(t, key, keyp, valuep)
+avltree_mt *t;
+void *key, **keyp, **valuep;
+{
+    return lookup(t, key, 1, keyp, valuep);
+}
+
+/* Writers: */
+
+static void write_begin(t)
+avltree_mt *t;
+{
+    pthread_mutex_lock(&t->lock);
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(t)
+avltree_mt *t;
+{
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+    try_advance(t);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void avltree_mt_insert(t, key, value)
+avltree_mt *t;
+void *key, *value;
+{
+    avltree_node *node, *parent, *new;
+    int cmp, gt;
+
+    write_begin(t);
+    parent = NULL;
+    gt = 0;
+    for (node = t->t.root; node; node = node->child[gt]) {
+        cmp = t->t.compar(key, node->key);
+        if (!cmp && t->t.inplace) {
+            if (AVL_HAS_VALUE(node))
+                retire(t, AVL_VALUE(node));
+            STORE_VALUE(node, value);
+            AVL_VALUE_CHANGED(&t->t, node);
+            AVL_INPLACE_HIT(&t->t, node);
+            free(key);
+            write_end(t);
+            return;
+        }
+        parent = node;
+        gt = cmp > 0;
+    }
+    new = avl_alloc_node(&t->t, sizeof(avltree_node));
+    new->key = key;
+    AVL_SET_VALUE(new, value);
+    /* Linked by a release store: readers that follow it see it complete. */
+    avl_link_node(&t->t, parent, gt, new);
+    write_end(t);
+}
+
+avltree_mt_remove(t, key, flags)
+avltree_mt *t;
+void *key;
+unsigned char flags;
+{
+    avltree_node *z;
+
+    write_begin(t);
+    if (!(z = avl_find_node(&t->t, t->t.root, key, NULL))) {
+        write_end(t);
+        return 1;
+    }
+    if (flags & AVLTREE_FREE_KEY)
+        retire(t, z->key);
+    if (flags & AVLTREE_FREE_VALUE && AVL_HAS_VALUE(z))
+        retire(t, AVL_VALUE(z));
+    /* The node itself is retired by node_free(). */
+    avl_remove(&t->t, z, AVLTREE_FREE_NONE);
+    write_end(t);
+    return 0;
+}
+
+/* Workers: */
+
+struct avltree_task {
+    void (*fn)(void *);
+    void *arg;
+    unsigned char done;
+};
+
+/* The pool this thread works in, and its deque there. */
+static __thread avltree_workers *pool;
+static __thread int self;
+
+static push(d, task)
+avltree_deque *d;
+struct avltree_task *task;
+{
+    struct avltree_task **p;
+    int i, cap;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->n == d->cap) {
+        cap = d->cap? 2 * d->cap : 64;
+        if (!(p = malloc(sizeof(struct avltree_task *) * cap))) {
+            pthread_mutex_unlock(&d->lock);
+            return 1;
+        }
+        for (i=0; i < d->n; i++)
+            p[i] = d->task[(d->head + i) % d->cap];
+        free(d->task);
+        d->task = p;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->task[(d->head + d->n++) % d->cap] = task;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+/* The owner pops the newest task, thieves the oldest. */
+static struct avltree_task *pop(d, back)
+avltree_deque *d;
+unsigned char back;
+{
+    struct avltree_task *task;
+
+    pthread_mutex_lock(&d->lock);
+    if (!d->n)
+        task = NULL;
+    else if (back)
+        task = d->task[(d->head + --d->n) % d->cap];
+    else {
+        task = d->task[d->head];
+        d->head = (d->head + 1) % d->cap;
+        d->n--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static struct avltree_task *take(w, id)
+avltree_workers *w;
+{
+    struct avltree_task *task;
+    int i;
+
+    if (!(task = pop(&w->deques[id], 1)))
+        for (i=1; i < w->nthreads && !task; i++)
+            task = pop(&w->deques[(id + i) % w->nthreads], 0);
+    if (task)
+        __atomic_fetch_sub(&w->queued, 1, __ATOMIC_RELAXED);
+    return task;
+}
+
+static void run(task)
+struct avltree_task *task;
+{
+    task->fn(task->arg);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+static int my_deque(w)
+avltree_workers *w;
+{
+    return pool == w? self : 0;
+}
+
+static void *spawn(ctx, fn, arg)
+void *ctx, *arg;
+void (*fn)(void *);
+{
+    avltree_workers *w;
+    struct avltree_task *task;
+
+    w = ctx;
+    if (!(task = malloc(sizeof(struct avltree_task))))
+        return NULL;
+    task->fn = fn;
+    task->arg = arg;
+    task->done = 0;
+    if (push(&w->deques[my_deque(w)], task)) {
+        free(task);
+        return NULL;
+    }
+    pthread_mutex_lock(&w->lock);
+    __atomic_fetch_add(&w->queued, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+static void sync_task(ctx, h)
+void *ctx, *h;
+{
+    avltree_workers *w;
+    struct avltree_task *task, *t;
+
+    w = ctx;
+    task = h;
+    if (!task)
+        /* spawn() could not queue it. */
+        return;
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+        if ((t = take(w, my_deque(w))))
+            run(t);
+        else
+            /* A thief runs it. */
+            sched_yield();
+    free(task);
+}
+
+static void *worker(arg)
+void *arg;
+{
+    avltree_workers *w;
+    struct avltree_task *task;
+
+    w = pool;
+    for (;;) {
+        if ((task = take(w, self))) {
+            run(task);
+            continue;
+        }
+        pthread_mutex_lock(&w->lock);
+        while (!__atomic_load_n(&w->queued, __ATOMIC_RELAXED) && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->stop) {
+            pthread_mutex_unlock(&w->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+struct worker_start {
+    avltree_workers *w;
+    int id;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char started;
+};
+
+static void *start(arg)
+void *arg;
+{
+    struct worker_start *s;
+
+    s = arg;
+    pool = s->w;
+    self = s->id;
+    pthread_mutex_lock(&s->lock);
+    s->started = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return worker(NULL);
+}
+
+avltree_workers_init(w, nthreads)
+avltree_workers *w;
+{
+    struct worker_start s;
+    int i;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    w->exec.spawn = spawn;
+    w->exec.sync = sync_task;
+    w->exec.ctx = w;
+    w->nthreads = nthreads;
+    w->queued = 0;
+    w->stop = 0;
+    if (!(w->deques = calloc(nthreads, sizeof(avltree_deque))))
+        return 1;
+    if (!(w->threads = malloc(sizeof(pthread_t) * nthreads))) {
+        free(w->deques);
+        return 1;
+    }
+    for (i=0; i < nthreads; i++)
+        pthread_mutex_init(&w->deques[i].lock, NULL);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    s.w = w;
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    for (i=1; i < nthreads; i++) {
+        s.id = i;
+        s.started = 0;
+        if (pthread_create(&w->threads[i], NULL, start, &s)) {
+            /* Runs with the threads it has. */
+            w->nthreads = i;
+            break;
+        }
+        pthread_mutex_lock(&s.lock);
+        while (!s.started)
+            pthread_cond_wait(&s.cond, &s.lock);
+        pthread_mutex_unlock(&s.lock);
+    }
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    return 0;
+}
+
+void avltree_workers_destroy(w)
+avltree_workers *w;
+{
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    for (i=1; i < w->nthreads; i++)
+        pthread_join(w->threads[i], NULL);
+    for (i=0; i < w->nthreads; i++) {
+        free(w->deques[i].task);
+        pthread_mutex_destroy(&w->deques[i].lock);
+    }
+    free(w->deques);
+    free(w->threads);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+}
+
+/* Sharded maps: */
+
+static shards_init(s, nshards, inplace, compar)
+avltree_sharded *s;
+unsigned char inplace;
+int (*compar)(const void *, const void *);
+{
+    avltree_shard *sh;
+    int i;
+
+    if (nshards < 1)
+        nshards = 1;
+    if (!(s->shard = malloc(sizeof(avltree_shard) * nshards)))
+        return 1;
+    for (i=0; i < nshards; i++) {
+        sh = &s->shard[i];
+        avltree_create(sh->t, inplace, compar, NULL, NULL);
+        /* Shared, so split() can leave nodes in it. */
+        avltree_pool_init(&sh->pool, sizeof(avltree_node), 0, 1);
+        avltree_use_pool(sh->t, sh->pool);
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->inserts = sh->removes = sh->finds = sh->contended = 0;
+    }
+    s->nshards = nshards;
+    s->inplace = inplace;
+    s->compar = compar;
+    s->split = NULL;
+    s->key_size = 0;
+    s->hash = NULL;
+    pthread_rwlock_init(&s->bounds, NULL);
+    return 0;
+}
+
+avltree_sharded_init(s, nshards, inplace, compar, key_size)
+avltree_sharded *s;
+unsigned char inplace;
+int (*compar)(const void *, const void *);
+size_t key_size;
+{
+    if (!key_size || shards_init(s, nshards, inplace, compar))
+        return 1;
+    if (!(s->split = calloc(s->nshards, sizeof(void *)))) {
+        avltree_sharded_destroy(s);
+        return 1;
+    }
+    s->key_size = key_size;
+    return 0;
+}
+
+avltree_sharded_init_hash(s, nshards, inplace, compar, hash)
+avltree_sharded *s;
+unsigned char inplace;
+int (*compar)(const void *, const void *);
+unsigned long (*hash)(const void *);
+{
+    if (shards_init(s, nshards, inplace, compar))
+        return 1;
+    s->hash = hash;
+    return 0;
+}
+
+void avltree_sharded_destroy(s)
+avltree_sharded *s;
+{
+    int i;
+
+    for (i=0; i < s->nshards; i++) {
+        avltree_destroy(s->shard[i].t);
+        avltree_pool_destroy(&s->shard[i].pool);
+        pthread_mutex_destroy(&s->shard[i].lock);
+        if (s->split)
+            free(s->split[i]);
+    }
+    free(s->shard);
+    free(s->split);
+    pthread_rwlock_destroy(&s->bounds);
+}
+
+/* A NULL KEY puts the splitter past every key. */
+static set_split(s, i, key)
+avltree_sharded *s;
+void *key;
+{
+    void *p;
+
+    if (!key) {
+        free(s->split[i]);
+        s->split[i] = NULL;
+        return 0;
+    }
+    if (!(p = s->split[i]) && !(p = malloc(s->key_size)))
+        return 1;
+    memcpy(p, key, s->key_size);
+    s->split[i] = p;
+    return 0;
+}
+
+static int (*sort_compar)(const void *, const void *);
+
+static compar_ptr(x, y)
+const void *x, *y;
+{
+    return sort_compar(*(void **)x, *(void **)y);
+}
+
+avltree_sharded_sample(s, keys, n)
+avltree_sharded *s;
+void **keys;
+{
+    void **sorted;
+    int i;
+
+    if (s->hash || !n)
+        return 0;
+    if (!(sorted = malloc(sizeof(void *) * n)))
+        return 1;
+    memcpy(sorted, keys, sizeof(void *) * n);
+    pthread_rwlock_wrlock(&s->bounds);
+    /* qsort() takes no context, and the bounds lock serializes this. */
+    sort_compar = s->compar;
+    qsort(sorted, n, sizeof(void *), compar_ptr);
+    for (i=0; i < s->nshards - 1; i++)
+        if (set_split(s, i, sorted[(long)(i + 1) * n / s->nshards]))
+            break;
+    pthread_rwlock_unlock(&s->bounds);
+    free(sorted);
+    return i < s->nshards - 1;
+}
+
+/* Call with the bounds lock held. */
+static avltree_shard *shard_of(s, key)
+avltree_sharded *s;
+void *key;
+{
+    int lo, hi, mid;
+
+    if (s->hash)
+        return &s->shard[s->hash(key) % s->nshards];
+    /* The first shard whose splitter is past key. */
+    lo = 0;
+    hi = s->nshards - 1;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (!s->split[mid] || s->compar(key, s->split[mid]) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return &s->shard[lo];
+}
+
+static avltree_shard *lock_shard(s, key)
+avltree_sharded *s;
+void *key;
+{
+    avltree_shard *sh;
+
+    pthread_rwlock_rdlock(&s->bounds);
+    sh = shard_of(s, key);
+    if (pthread_mutex_trylock(&sh->lock)) {
+        pthread_mutex_lock(&sh->lock);
+        sh->contended++;
+    }
+    return sh;
+}
+
+static void unlock_shard(s, sh)
+avltree_sharded *s;
+avltree_shard *sh;
+{
+    pthread_mutex_unlock(&sh->lock);
+    pthread_rwlock_unlock(&s->bounds);
+}
+
+void avltree_sharded_insert(s, key, value)
+avltree_sharded *s;
+void *key, *value;
+{
+    avltree_shard *sh;
+
+    sh = lock_shard(s, key);
+    avltree_insert(&sh->t, key, value);
+    sh->inserts++;
+    unlock_shard(s, sh);
+}
+
+avltree_sharded_find(s, key, keyp, valuep)
+avltree_sharded *s;
+void *key, **keyp, **valuep;
+{
+    avltree_shard *sh;
+    avltree_node *n;
+
+    sh = lock_shard(s, key);
+    if ((n = avltree_find_node(sh->t, key))) {
+        if (keyp)
+            *keyp = n->key;
+        if (valuep)
+            *valuep = AVL_VALUE(n);
+    }
+    sh->finds++;
+    unlock_shard(s, sh);
+    return n != NULL;
+}
+
+avltree_sharded_remove(s, key, flags)
+avltree_sharded *s;
+void *key;
+unsigned char flags;
+{
+    avltree_shard *sh;
+    int ret;
+
+    sh = lock_shard(s, key);
+    ret = avltree_remove(&sh->t, key, flags);
+    sh->removes++;
+    unlock_shard(s, sh);
+    return ret;
+}
+
+/* The Ith node of t from the smallest, or from the largest if MAX. */
+static avltree_node *nth(t, i, max)
+avltree_tree *t;
+unsigned char max;
+{
+    avltree_node *n;
+
+    n = max? avl_find_max(t, t->root) : avl_find_min(t, t->root);
+    while (i--)
+        n = max? avl_prev(n) : avl_next(n);
+    return n;
+}
+
+/* Nodes before n with a key equal to its own. */
+static equal_before(t, n)
+avltree_tree *t;
+avltree_node *n;
+{
+    avltree_node *p;
+    int e;
+
+    for (e = 0, p = avl_prev(n); p && !t->compar(p->key, n->key); p = avl_prev(p))
+        e++;
+    return e;
+}
+
+/* Moves the M largest keys of a to the front of b, and those equal to
+   them. Splits are given their sizes, so that this costs O(keys moved)
+   without AVLTREE_SIZE too. */
+static void move_up(a, b, m)
+avltree_tree *a, *b;
+{
+    avltree_tree hi, dst;
+    avltree_node *n;
+
+    n = nth(a, m - 1, 1);
+    avl_split(a, n->key, a, &hi, a->nmemb - m - equal_before(a, n));
+    /* Copy hi into the pool of b, then join without copying b. */
+    dst = *b;
+    dst.root = NULL;
+    dst.nmemb = 0;
+    avltree_join(&dst, NULL, NULL, &hi);
+    avltree_join(&dst, NULL, NULL, b);
+    *b = dst;
+}
+
+/* Moves the M smallest keys of b to the back of a, or fewer: keys equal
+   to the first one left behind stay in b with it. */
+static void move_down(a, b, m)
+avltree_tree *a, *b;
+{
+    avltree_tree lo;
+    avltree_node *n;
+
+    if (m == b->nmemb) {
+        avltree_join(a, NULL, NULL, b);
+        return;
+    }
+    n = nth(b, m, 0);
+    avl_split(b, n->key, &lo, b, m - equal_before(b, n));
+    avltree_join(a, NULL, NULL, &lo);
+}
+
+void avltree_sharded_rebalance(s)
+avltree_sharded *s;
+{
+    avltree_tree *a, *b;
+    long total, want;
+    int i, j, m;
+
+    if (s->hash)
+        return;
+    pthread_rwlock_wrlock(&s->bounds);
+    for (total = 0, i=0; i < s->nshards; i++)
+        total += s->shard[i].t.nmemb;
+    for (i=0; i < s->nshards - 1; i++) {
+        a = &s->shard[i].t;
+        want = (i + 1) * total / s->nshards - i * total / s->nshards;
+        if (a->nmemb > want)
+            move_up(a, &s->shard[i + 1].t, a->nmemb - want);
+        for (j = i + 1; a->nmemb < want && j < s->nshards; j++) {
+            b = &s->shard[j].t;
+            m = want - a->nmemb < b->nmemb? want - a->nmemb : b->nmemb;
+            if (m)
+                move_down(a, b, m);
+            /* Equal keys never straddle shards; a run that did not fit
+               stays whole in b, and a stays short. */
+            if (b->nmemb)
+                break;
+        }
+    }
+    /* The splitter of a shard left empty is that of the next one. On
+       failure the old splitter stays: it still bounds the keys until the
+       next rebalance moves them. */
+    for (i = s->nshards - 2; i >= 0; i--)
+        if (s->shard[i + 1].t.root)
+            set_split(s, i, avltree_find_min(s->shard[i + 1].t)->key);
+        else if (!s->split[i + 1] || set_split(s, i, s->split[i + 1]))
+            set_split(s, i, NULL);
+    pthread_rwlock_unlock(&s->bounds);
+}
+
+/* Iteration: */
+
+static unsigned char heap_less(it, a, b)
+avltree_sharded_iter *it;
+{
+    return it->s->compar(it->cur[it->heap[a]]->key, it->cur[it->heap[b]]->key) < 0;
+}
+
+static void sift_down(it, i)
+avltree_sharded_iter *it;
+{
+    int c, tmp;
+
+    for (; (c = 2 * i + 1) < it->nheap; i = c) {
+        if (c + 1 < it->nheap && heap_less(it, c + 1, c))
+            c++;
+        if (!heap_less(it, c, i))
+            break;
+        tmp = it->heap[i];
+        it->heap[i] = it->heap[c];
+        it->heap[c] = tmp;
+    }
+}
+
+avltree_node *avltree_sharded_first(it, s)
+avltree_sharded_iter *it;
+avltree_sharded *s;
+{
+    int i;
+
+    it->s = s;
+    it->nheap = 0;
+    it->cur = malloc(sizeof(avltree_node *) * s->nshards);
+    it->heap = malloc(sizeof(int) * s->nshards);
+    pthread_rwlock_rdlock(&s->bounds);
+    for (i=0; i < s->nshards; i++)
+        pthread_mutex_lock(&s->shard[i].lock);
+    if (!it->cur || !it->heap)
+        return NULL;
+    for (i=0; i < s->nshards; i++)
+        if ((it->cur[i] = avltree_find_min(s->shard[i].t)))
+            it->heap[it->nheap++] = i;
+    /* Ranged shards are already in order. */
+    if (s->hash)
+        for (i = it->nheap / 2 - 1; i >= 0; i--)
+            sift_down(it, i);
+    return it->nheap? it->cur[it->heap[0]] : NULL;
+}
+
+avltree_node *avltree_sharded_next(it)
+avltree_sharded_iter *it;
+{
+    int i;
+
+    if (!it->nheap)
+        return NULL;
+    i = it->heap[0];
+    if ((it->cur[i] = avl_next(it->cur[i]))) {
+        if (it->s->hash)
+            sift_down(it, 0);
+    } else if (it->s->hash) {
+        it->heap[0] = it->heap[--it->nheap];
+        sift_down(it, 0);
+    } else
+        memmove(it->heap, it->heap + 1, sizeof(int) * --it->nheap);
+    return it->nheap? it->cur[it->heap[0]] : NULL;
+}
+
+void avltree_sharded_end(it)
+avltree_sharded_iter *it;
+{
+    int i;
+
+    for (i=0; i < it->s->nshards; i++)
+        pthread_mutex_unlock(&it->s->shard[i].lock);
+    pthread_rwlock_unlock(&it->s->bounds);
+    free(it->cur);
+    free(it->heap);
+}
@@ -0,0 +1,172 @@
+/*
+    avltree_mt.h
+    Concurrent AVL tree on top of avltree.
+    Copyright (C) 2025  João Manica  <joaoedisonmanica@gmail.com>
+
+    avltree_mt.h is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+    more details.
+*/
+
+#ifndef AVLTREE_MT_H
+#define AVLTREE_MT_H
+
+#include <pthread.h>
+#include "avltree.h"
+
+/*
+    Writers take a mutex and bump a sequence counter around every change.
+    Readers do not lock: they search the tree and retry if the counter moved
+    meanwhile. Removed nodes, keys and values are only freed once every
+    reader that could still see them has left, tracked with epochs.
+
+    Every thread that reads registers an avltree_mt_reader, and searches
+    between avltree_mt_enter() and avltree_mt_leave(); the keys and values
+    returned stay valid until then.
+*/
+
+/* Pointers retired in an epoch. */
+typedef struct {
+    void **ptr;
+    size_t n, cap;
+} avltree_mt_limbo;
+
+typedef struct avltree_mt_reader {
+    struct avltree_mt_reader *next;
+    /* Epoch << 1 | active. */
+    unsigned long state;
+} avltree_mt_reader;
+
+typedef struct {
+    avltree_tree t;
+    pthread_mutex_t lock;
+    /* Odd while a writer changes the tree. */
+    unsigned long seq;
+    unsigned long epoch;
+    avltree_mt_reader *readers;
+    avltree_mt_limbo limbo[3];
+    /* Frees the nodes of t into limbo. */
+    avltree_allocator alloc;
+} avltree_mt;
+
+void avltree_mt_init(avltree_mt *t, unsigned char inplace, int (*compar)(const void *, const void *));
+/* No reader may be registered. Frees keys and values as avltree_destroy(). */
+void avltree_mt_destroy(avltree_mt *t);
+
+void avltree_mt_reader_init(avltree_mt *t, avltree_mt_reader *r);
+void avltree_mt_reader_destroy(avltree_mt *t, avltree_mt_reader *r);
+void avltree_mt_enter(avltree_mt *t, avltree_mt_reader *r);
+void avltree_mt_leave(avltree_mt *t, avltree_mt_reader *r);
+
+/* Return 1 and store the key and value of the node found, or return 0.
+   KEYP and VALUEP may be NULL. */
+int avltree_mt_find(avltree_mt *t, void *key, void **keyp, void **valuep);
+/* First key >= KEY. */
+int avltree_mt_lower_bound(avltree_mt *t, void *key, void **keyp, void **valuep);
+
+/* As avltree_insert() and avltree_remove(), but freeing the replaced value
+   and the removed key and value once no reader can see them. */
+void avltree_mt_insert(avltree_mt *t, void *key, void *value);
+int avltree_mt_remove(avltree_mt *t, void *key, unsigned char flags);
+
+/*
+    Work-stealing pool for the avltree_par_ routines of avltree.h. Every
+    thread pushes the tasks it spawns on its own deque and pops from its
+    back; idle threads steal from the front of other deques. A thread
+    waiting in sync() runs other tasks meanwhile.
+*/
+
+typedef struct {
+    struct avltree_task **task;
+    int head, n, cap;
+    pthread_mutex_t lock;
+} avltree_deque;
+
+typedef struct avltree_workers {
+    /* Pass &w->exec to avltree_par_ routines. */
+    avltree_exec exec;
+    int nthreads;
+    pthread_t *threads;
+    /* One per thread; deque 0 is for threads outside the pool. */
+    avltree_deque *deques;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Tasks in the deques. */
+    unsigned long queued;
+    unsigned char stop;
+} avltree_workers;
+
+/* NTHREADS counts the calling thread, so NTHREADS - 1 are started. */
+int avltree_workers_init(avltree_workers *w, int nthreads);
+void avltree_workers_destroy(avltree_workers *w);
+
+/*
+    Sharded map: keys are spread over trees that each have their own lock
+    and pool, either by range, between splitter keys, or by hash for maps
+    that only see point operations. Range splitters come from a sample of
+    keys and are moved by avltree_sharded_rebalance() as the shards fill.
+*/
+
+typedef struct {
+    avltree_tree t;
+    pthread_mutex_t lock;
+    avltree_pool pool;
+    /* Operations on this shard, and how many found it locked. Read them
+       without a lock for an estimate. */
+    unsigned long inserts, removes, finds, contended;
+} avltree_shard;
+
+typedef struct {
+    avltree_shard *shard;
+    int nshards;
+    unsigned char inplace;
+    int (*compar)(const void *, const void *);
+    /* Shard i holds the keys in [split[i-1], split[i]); a NULL splitter is
+       past every key. */
+    void **split;
+    /* Bytes of a key, copied into each splitter so that it outlives the
+       key it came from. */
+    size_t key_size;
+    /* Non-NULL for a hashed map. */
+    unsigned long (*hash)(const void *);
+    /* Taken for writing while splitters move. */
+    pthread_rwlock_t bounds;
+} avltree_sharded;
+
+/* Returns nonzero if out of memory, or if KEY_SIZE is 0. */
+int avltree_sharded_init(avltree_sharded *s, int nshards, unsigned char inplace, int (*compar)(const void *, const void *), size_t key_size);
+int avltree_sharded_init_hash(avltree_sharded *s, int nshards, unsigned char inplace, int (*compar)(const void *, const void *), unsigned long (*hash)(const void *));
+/* Frees keys and values as avltree_destroy(). */
+void avltree_sharded_destroy(avltree_sharded *s);
+
+/* Picks the splitters of an empty ranged map from N sample KEYS. */
+int avltree_sharded_sample(avltree_sharded *s, void **keys, int n);
+/* Moves keys between neighbouring shards until they hold about as many,
+   in O(keys moved). Blocks every other operation meanwhile. */
+void avltree_sharded_rebalance(avltree_sharded *s);
+
+/* As the avltree_mt_ functions; the map must not change while the key and
+   value returned are in use. */
+void avltree_sharded_insert(avltree_sharded *s, void *key, void *value);
+int avltree_sharded_find(avltree_sharded *s, void *key, void **keyp, void **valuep);
+int avltree_sharded_remove(avltree_sharded *s, void *key, unsigned char flags);
+
+/* Iterates over every shard in key order, merging hashed shards. Holds
+   every shard lock from avltree_sharded_first() to avltree_sharded_end(). */
+typedef struct {
+    avltree_sharded *s;
+    /* Next node of each shard, and a heap of the shards by it. */
+    avltree_node **cur;
+    int *heap, nheap;
+} avltree_sharded_iter;
+
+avltree_node *avltree_sharded_first(avltree_sharded_iter *it, avltree_sharded *s);
+avltree_node *avltree_sharded_next(avltree_sharded_iter *it);
+void avltree_sharded_end(avltree_sharded_iter *it);
+
+#endif
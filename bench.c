@@ -0,0 +1,770 @@
+/*
+    AVL tree benchmarks. Each asserts what its operations found, so build
+    it without NDEBUG.
+    Copyright (C) 2025  João Manica
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+    more details.
+*/
+
+#include "avltree.h"
+#include "avltree_mt.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned long ncompar;
+
+AVLTREE_DEFINE(itree, int, AVLTREE_CMP)
+
+compar(x, y)
+void *x, *y;
+{
+    ncompar++;
+    return (*(int*)x > *(int*)y) - (*(int*)x < *(int*)y);
+}
+
+compar64(x, y)
+void *x, *y;
+{
+    ncompar++;
+    return (*(int64_t*)x > *(int64_t*)y) - (*(int64_t*)x < *(int64_t*)y);
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_insert(n, mod, inplace)
+int n, mod;
+unsigned char inplace;
+{
+    avltree_tree t;
+    double start;
+    int i, *key;
+
+    avltree_create(t, inplace, compar, NULL, NULL);
+    srand(1);
+    ncompar = 0;
+    start = now();
+    for (i=0; i < n; i++) {
+        key = malloc(sizeof(int));
+        *key = rand() % mod;
+        avltree_insert_key(t, key);
+    }
+    printf("insert n=%d mod=%d inplace=%d: %.3f s, %.2f compar/insert\n",
+           n, mod, inplace, now() - start, (double)ncompar / n);
+    avltree_destroy(t);
+}
+
+static void *make_count(ctx, probe, valuep)
+void *ctx, *probe, **valuep;
+{
+    int *key;
+
+    key = malloc(sizeof(int));
+    *key = *(int *)probe;
+    *valuep = malloc(sizeof(int));
+    *(int *)*valuep = 1;
+    return key;
+}
+
+static void add_count(ctx, n)
+void *ctx;
+avltree_node *n;
+{
+    ++*(int *)AVL_VALUE(n);
+}
+
+/* Counts keys in place; against bench_insert() with the same mod, only the
+   first occurrence of each key allocates. */
+static void bench_upsert(n, mod)
+int n, mod;
+{
+    avltree_tree t;
+    avltree_node *node;
+    double start;
+    int i, key;
+
+    avltree_create(t, 1, compar, NULL, NULL);
+    srand(1);
+    ncompar = 0;
+    start = now();
+    for (i=0; i < n; i++) {
+        key = rand() % mod;
+        avltree_upsert(&t, &key, make_count, add_count, NULL);
+    }
+    printf("upsert n=%d mod=%d: %.3f s, %.2f compar/upsert\n",
+           n, mod, now() - start, (double)ncompar / n);
+    for (i = 0, node = avltree_find_min(t); node; node = avl_next(node))
+        i += *(int *)AVL_VALUE(node);
+    assert(i == n);
+    avltree_destroy(t);
+}
+
+static void bench_traverse(n)
+int n;
+{
+    avltree_tree t;
+    double start;
+    int i, *key, *arr, nmemb, found;
+
+    avltree_create(t, 1, compar, NULL, NULL);
+    srand(1);
+    for (i=0; i < n; i++) {
+        key = malloc(sizeof(int));
+        *key = rand();
+        avltree_insert_key(t, key);
+    }
+    arr = malloc(sizeof(int) * t.nmemb);
+    nmemb = 0;
+    start = now();
+    avltree_keys_to_array(t, (unsigned char *)arr, sizeof(int), &nmemb, t.nmemb);
+    printf("keys_to_array n=%d: %.3f s\n", n, now() - start);
+    assert(nmemb == t.nmemb);
+    start = now();
+    for (found = i = 0; i < nmemb; i++)
+        found += avltree_find_node(t, &arr[i]) != NULL;
+    printf("find n=%d: %.3f s\n", n, now() - start);
+    assert(found == nmemb);
+    start = now();
+    avltree_destroy(t);
+    printf("destroy n=%d: %.3f s\n", n, now() - start);
+    free(arr);
+}
+
+static void bench_build(n)
+int n;
+{
+    avltree_tree t;
+    double start;
+    void **keys;
+    int i;
+
+    keys = malloc(sizeof(void *) * n);
+    avltree_create(t, 1, compar, NULL, NULL);
+    start = now();
+    for (i=0; i < n; i++) {
+        keys[i] = malloc(sizeof(int));
+        *(int*)keys[i] = i;
+        avltree_insert_key(t, keys[i]);
+    }
+    printf("insert sorted n=%d: %.3f s\n", n, now() - start);
+    assert(t.nmemb == n);
+    avltree_destroy(t);
+    start = now();
+    for (i=0; i < n; i++) {
+        keys[i] = malloc(sizeof(int));
+        *(int*)keys[i] = i;
+    }
+    avltree_insert_batch(&t, keys, NULL, n);
+    printf("build sorted n=%d: %.3f s\n", n, now() - start);
+    assert(t.nmemb == n);
+    avltree_destroy(t);
+    free(keys);
+}
+
+/* Batches of K random keys into a tree of N. */
+static void bench_batch(n, k)
+int n, k;
+{
+    avltree_tree t;
+    double start;
+    void **keys;
+    int i, pass;
+
+    keys = malloc(sizeof(void *) * k);
+    for (pass = 0; pass < 2; pass++) {
+        srand(1);
+        avltree_create(t, 0, compar, NULL, NULL);
+        for (i=0; i < n; i++) {
+            keys[0] = malloc(sizeof(int));
+            *(int*)keys[0] = rand() / 2 * 2;
+            avltree_insert_key(t, keys[0]);
+        }
+        for (i=0; i < k; i++) {
+            keys[i] = malloc(sizeof(int));
+            /* Odd, so that removing them leaves the tree as it was. */
+            *(int*)keys[i] = rand() / 2 * 2 + 1;
+        }
+        ncompar = 0;
+        start = now();
+        if (pass)
+            avltree_insert_batch(&t, keys, NULL, k);
+        else
+            for (i=0; i < k; i++)
+                avltree_insert_key(t, keys[i]);
+        printf("%s n=%d k=%d: %.3f s, %.2f compar/key", pass? "insert_batch" : "insert",
+               n, k, now() - start, (double)ncompar / k);
+        assert(t.nmemb == n + k);
+        ncompar = 0;
+        start = now();
+        if (pass)
+            avltree_remove_batch(&t, keys, k, AVLTREE_FREE_NONE);
+        else
+            for (i=0; i < k; i++)
+                avltree_remove_node(t, keys[i], AVLTREE_FREE_NONE);
+        printf("; remove %.3f s, %.2f compar/key\n", now() - start, (double)ncompar / k);
+        assert(t.nmemb == n);
+        for (i=0; i < k; i++)
+            free(keys[i]);
+        avltree_destroy(t);
+    }
+    free(keys);
+}
+
+static void random_tree(t, n, mod, parity)
+avltree_tree *t;
+int n, mod, parity;
+{
+    int i, *key;
+
+    avltree_create((*t), 1, compar, NULL, NULL);
+    for (i=0; i < n; i++) {
+        key = malloc(sizeof(int));
+        *key = rand() % mod * 2 + parity;
+        avltree_insert_key_ptr(t, key);
+    }
+}
+
+static void bench_set(n)
+int n;
+{
+    avltree_tree a, b;
+    double start;
+    int na;
+
+    srand(1);
+    /* Disjoint, as avl_copy_keys() would free the keys of b found in a. */
+    random_tree(&a, n, 4*n, 0);
+    random_tree(&b, n, 4*n, 1);
+    na = a.nmemb;
+    start = now();
+    avltree_copy_keys(a, b);
+    avltree_diff(a, b, AVLTREE_FREE_NONE);
+    printf("copy_keys + diff n=%d: %.3f s\n", n, now() - start);
+    assert(a.nmemb == na);
+    start = now();
+    avltree_union(a, b, 0, AVLTREE_FREE_NONE);
+    avltree_difference(a, b, 0, AVLTREE_FREE_NONE);
+    printf("union + difference n=%d: %.3f s\n", n, now() - start);
+    assert(a.nmemb == na);
+    avltree_destroy(a);
+    avltree_destroy(b);
+}
+
+static void bench_typed(n)
+int n;
+{
+    avltree_tree t, u;
+    double start;
+    int i, *keys, *key, found;
+
+    keys = malloc(sizeof(int) * n);
+    srand(1);
+    avltree_create(t, 1, compar, NULL, NULL);
+    itree_create(&u, 1);
+    for (i=0; i < n; i++) {
+        keys[i] = rand();
+        key = malloc(sizeof(int));
+        *key = keys[i];
+        avltree_insert_key(t, key);
+        itree_insert(&u, keys[i], NULL);
+    }
+    start = now();
+    for (found = i = 0; i < n; i++)
+        found += avltree_find_node(t, &keys[i]) != NULL;
+    printf("find n=%d: %.3f s\n", n, now() - start);
+    assert(found == n);
+    start = now();
+    for (found = i = 0; i < n; i++)
+        found += itree_find(&u, keys[i]) != NULL;
+    printf("typed find n=%d: %.3f s\n", n, now() - start);
+    assert(found == n);
+    avltree_destroy(t);
+    itree_destroy(&u, AVLTREE_FREE_NONE);
+    free(keys);
+}
+
+/* Lookups of random keys, from cache resident sizes up to about 4N. */
+static void bench_frozen(n)
+int n;
+{
+    avltree_tree t;
+    avltree_frozen f, g;
+    double start;
+    int i, m, q, *keys, *key, found, ffound, gfound;
+
+    q = 1000000;
+    keys = malloc(sizeof(int) * q);
+    for (m = 1 << 14; m <= 4 * n; m *= 4) {
+        srand(1);
+        avltree_create(t, 1, compar, NULL, NULL);
+        for (i=0; i < m; i++) {
+            key = malloc(sizeof(int));
+            *key = rand() % m;
+            avltree_insert_key(t, key);
+        }
+        for (i=0; i < q; i++)
+            keys[i] = rand() % m;
+        avltree_freeze(&t, &f, 0);
+        avltree_freeze(&t, &g, sizeof(int));
+        start = now();
+        for (found = i = 0; i < q; i++)
+            found += avltree_find_node(t, &keys[i]) != NULL;
+        printf("n=%d: find %.3f s", m, now() - start);
+        start = now();
+        for (ffound = i = 0; i < q; i++)
+            ffound += avltree_frozen_find(&f, &keys[i]) != 0;
+        printf(", frozen find %.3f s", now() - start);
+        start = now();
+        for (gfound = i = 0; i < q; i++)
+            gfound += avltree_frozen_find(&g, &keys[i]) != 0;
+        printf(", frozen find with key copies %.3f s\n", now() - start);
+        assert(ffound == found && gfound == found);
+        avltree_frozen_destroy(&f);
+        avltree_frozen_destroy(&g);
+        avltree_destroy(t);
+    }
+    free(keys);
+}
+
+/* Batches of random int64_t probes, half of them absent. */
+static void bench_frozen64(n)
+int n;
+{
+    avltree_tree t;
+    avltree_frozen f;
+    avltree_frozen64 g;
+    double start;
+    int i, m, q, *out, found, ffound, gfound;
+    int64_t *keys, *key;
+
+    q = 1000000;
+    keys = malloc(sizeof(int64_t) * q);
+    out = malloc(sizeof(int) * q);
+    for (m = 1 << 14; m <= 4 * n; m *= 4) {
+        srand(1);
+        avltree_create(t, 1, compar64, NULL, NULL);
+        for (i=0; i < m; i++) {
+            key = malloc(sizeof(int64_t));
+            *key = (int64_t)(rand() % m) * 2;
+            avltree_insert_key(t, key);
+        }
+        for (i=0; i < q; i++)
+            keys[i] = rand() % (2 * m);
+        avltree_freeze(&t, &f, sizeof(int64_t));
+        avltree_freeze64(&t, &g);
+        start = now();
+        for (found = i = 0; i < q; i++)
+            found += avltree_find_node(t, &keys[i]) != NULL;
+        printf("n=%d: find %.3f s", m, now() - start);
+        start = now();
+        for (ffound = i = 0; i < q; i++)
+            ffound += avltree_frozen_find(&f, &keys[i]) != 0;
+        printf(", frozen %.3f s", now() - start);
+        start = now();
+        for (i=0; i < q; i++)
+            out[i] = avltree_frozen64_find(&g, keys[i]);
+        printf(", frozen64 %.3f s", now() - start);
+        for (gfound = i = 0; i < q; i++)
+            gfound += out[i] >= 0;
+        assert(ffound == found && gfound == found);
+        start = now();
+        avltree_frozen64_find_batch(&g, keys, q, out);
+        printf(", frozen64 batch %.3f s\n", now() - start);
+        for (gfound = i = 0; i < q; i++)
+            gfound += out[i] >= 0;
+        assert(gfound == found);
+        avltree_frozen_destroy(&f);
+        avltree_frozen64_destroy(&g);
+        avltree_destroy(t);
+    }
+    free(keys);
+    free(out);
+}
+
+/* Snapshots: a persistent version against avl_copy_keys(). */
+static void bench_persistent(n)
+int n;
+{
+    avltree_ptree p, snap;
+    avltree_tree t, u;
+    double start;
+    int i, *keys;
+
+    keys = malloc(sizeof(int) * n);
+    srand(1);
+    for (i=0; i < n; i++)
+        keys[i] = rand();
+    avltree_pcreate(p, 1, compar);
+    start = now();
+    for (i=0; i < n; i++)
+        avltree_pinsert(&p, &p, &keys[i], NULL);
+    printf("persistent insert n=%d: %.3f s\n", n, now() - start);
+    start = now();
+    avltree_psnapshot(&snap, &p);
+    printf("persistent snapshot n=%d: %.6f s\n", n, now() - start);
+    assert(snap.nmemb == p.nmemb);
+    start = now();
+    for (i=0; i < n; i++)
+        avltree_premove(&p, &p, &keys[i]);
+    printf("persistent remove n=%d, under a snapshot: %.3f s\n", n, now() - start);
+    assert(!p.nmemb && snap.nmemb);
+    avltree_prelease(&snap);
+    avltree_prelease(&p);
+
+    /* Not inplace: the keys are not allocated one by one. */
+    avltree_create(t, 0, compar, NULL, NULL);
+    avltree_create(u, 0, compar, NULL, NULL);
+    for (i=0; i < n; i++)
+        avltree_insert_key(t, &keys[i]);
+    start = now();
+    avltree_copy_keys(u, t);
+    printf("copy_keys n=%d: %.3f s\n", n, now() - start);
+    assert(u.nmemb == n);
+    avltree_empty(t);
+    avltree_empty(u);
+    free(keys);
+}
+
+static const void *save_int(ctx, key, len)
+void *ctx, *key;
+size_t *len;
+{
+    *len = sizeof(int);
+    return key;
+}
+
+static void *load_int(ctx, data, len)
+void *ctx;
+const void *data;
+size_t len;
+{
+    int *key;
+
+    key = malloc(sizeof(int));
+    memcpy(key, data, sizeof(int));
+    return key;
+}
+
+/* Saving and reloading a tree of N random keys, against inserting them. */
+static void bench_snapshot(n)
+int n;
+{
+    avltree_codec c = {save_int, NULL, load_int, NULL, NULL};
+    avltree_mapped m;
+    avltree_tree t;
+    double start;
+    FILE *f;
+    int i, nmemb, found;
+
+    srand(1);
+    start = now();
+    random_tree(&t, n, n, 0);
+    printf("insert n=%d: %.3f s\n", n, now() - start);
+    nmemb = t.nmemb;
+    f = fopen("bench.snapshot", "wb");
+    start = now();
+    avltree_save(&t, f, &c);
+    fclose(f);
+    printf("save n=%d: %.3f s\n", n, now() - start);
+    avltree_destroy(t);
+    f = fopen("bench.snapshot", "rb");
+    start = now();
+    avltree_load(&t, f, &c);
+    fclose(f);
+    printf("load n=%d: %.3f s\n", n, now() - start);
+    assert(t.nmemb == nmemb);
+    start = now();
+    avltree_map(&m, "bench.snapshot", compar);
+    for (found = i = 0; i < n; i++)
+        found += avltree_mapped_find(&m, &i) >= 0;
+    printf("map + %d mapped finds: %.3f s\n", n, now() - start);
+    for (i=0; i < n; i++)
+        found -= avltree_find_node(t, &i) != NULL;
+    assert(!found);
+    avltree_unmap(&m);
+    avltree_destroy(t);
+    remove("bench.snapshot");
+}
+
+/* Readers looking up random keys while a writer inserts and removes, with
+   a mutex around avltree calls or with avltree_mt. */
+#define NREADERS 4
+
+static struct {
+    avltree_tree t;
+    pthread_mutex_t lock;
+    avltree_mt mt;
+    int n, lookups, use_mt, stop;
+} mtb;
+
+static void *mt_reader(arg)
+void *arg;
+{
+    avltree_mt_reader r;
+    unsigned seed;
+    int i, key;
+
+    seed = (unsigned)(size_t)arg;
+    if (mtb.use_mt) {
+        avltree_mt_reader_init(&mtb.mt, &r);
+        avltree_mt_enter(&mtb.mt, &r);
+    }
+    for (i=0; i < mtb.lookups; i++) {
+        key = rand_r(&seed) % mtb.n * 2;
+        if (mtb.use_mt) {
+            avltree_mt_find(&mtb.mt, &key, NULL, NULL);
+            /* Let the writer free what it removed. */
+            if (i % 64 == 63) {
+                avltree_mt_leave(&mtb.mt, &r);
+                avltree_mt_enter(&mtb.mt, &r);
+            }
+        } else {
+            pthread_mutex_lock(&mtb.lock);
+            avltree_find_node(mtb.t, &key);
+            pthread_mutex_unlock(&mtb.lock);
+        }
+    }
+    if (mtb.use_mt) {
+        avltree_mt_leave(&mtb.mt, &r);
+        avltree_mt_reader_destroy(&mtb.mt, &r);
+    }
+    return NULL;
+}
+
+static void *mt_writer(arg)
+void *arg;
+{
+    int *key;
+
+    while (!__atomic_load_n(&mtb.stop, __ATOMIC_RELAXED)) {
+        key = malloc(sizeof(int));
+        *key = rand() % mtb.n * 2 + 1;
+        if (mtb.use_mt) {
+            avltree_mt_insert(&mtb.mt, key, NULL);
+            avltree_mt_remove(&mtb.mt, key, AVLTREE_FREE_KEY);
+        } else {
+            pthread_mutex_lock(&mtb.lock);
+            avltree_insert_key(mtb.t, key);
+            avltree_remove_node(mtb.t, key, AVLTREE_FREE_KEY);
+            pthread_mutex_unlock(&mtb.lock);
+        }
+    }
+    return NULL;
+}
+
+static void bench_mt(n)
+int n;
+{
+    pthread_t readers[NREADERS], writer;
+    double start;
+    int i, *key;
+
+    mtb.n = n;
+    mtb.lookups = 1000000;
+    for (mtb.use_mt = 0; mtb.use_mt < 2; mtb.use_mt++) {
+        srand(1);
+        if (mtb.use_mt)
+            avltree_mt_init(&mtb.mt, 1, compar);
+        else {
+            avltree_create(mtb.t, 1, compar, NULL, NULL);
+            pthread_mutex_init(&mtb.lock, NULL);
+        }
+        for (i=0; i < n; i++) {
+            key = malloc(sizeof(int));
+            *key = i * 2;
+            if (mtb.use_mt)
+                avltree_mt_insert(&mtb.mt, key, NULL);
+            else
+                avltree_insert_key(mtb.t, key);
+        }
+        mtb.stop = 0;
+        start = now();
+        pthread_create(&writer, NULL, mt_writer, NULL);
+        for (i=0; i < NREADERS; i++)
+            pthread_create(&readers[i], NULL, mt_reader, (void *)(size_t)(i + 1));
+        for (i=0; i < NREADERS; i++)
+            pthread_join(readers[i], NULL);
+        __atomic_store_n(&mtb.stop, 1, __ATOMIC_RELAXED);
+        pthread_join(writer, NULL);
+        printf("%s n=%d: %d readers x %d lookups with a writer: %.3f s\n",
+               mtb.use_mt? "avltree_mt" : "mutex", n, NREADERS, mtb.lookups, now() - start);
+        /* The writer removes every key it inserts. */
+        assert((mtb.use_mt? mtb.mt.t.nmemb : mtb.t.nmemb) == n);
+        if (mtb.use_mt)
+            avltree_mt_destroy(&mtb.mt);
+        else {
+            avltree_destroy(mtb.t);
+            pthread_mutex_destroy(&mtb.lock);
+        }
+    }
+}
+
+/* Writers inserting into one locked tree, or into a sharded map. */
+#define NWRITERS 4
+#define NSHARDS 16
+
+static struct {
+    avltree_tree t;
+    pthread_mutex_t lock;
+    avltree_sharded s;
+    int n, sharded;
+} shb;
+
+static unsigned long hash(key)
+const void *key;
+{
+    return *(unsigned *)key * 2654435761u;
+}
+
+static void *shard_writer(arg)
+void *arg;
+{
+    unsigned seed;
+    int i, *key;
+
+    seed = (unsigned)(size_t)arg;
+    for (i=0; i < shb.n / NWRITERS; i++) {
+        key = malloc(sizeof(int));
+        *key = rand_r(&seed);
+        if (shb.sharded)
+            avltree_sharded_insert(&shb.s, key, NULL);
+        else {
+            pthread_mutex_lock(&shb.lock);
+            avltree_insert_key(shb.t, key);
+            pthread_mutex_unlock(&shb.lock);
+        }
+    }
+    return NULL;
+}
+
+static void bench_sharded(n)
+int n;
+{
+    static char *name[] = {"mutex", "sharded by range", "sharded by hash"};
+    pthread_t writers[NWRITERS];
+    unsigned long contended;
+    void *sample[1024];
+    double start;
+    int i, nmemb, total;
+
+    shb.n = n;
+    for (i=0; i < 1024; i++) {
+        sample[i] = malloc(sizeof(int));
+        *(int *)sample[i] = rand();
+    }
+    for (shb.sharded = 0; shb.sharded < 3; shb.sharded++) {
+        if (shb.sharded == 1) {
+            avltree_sharded_init(&shb.s, NSHARDS, 1, compar, sizeof(int));
+            avltree_sharded_sample(&shb.s, sample, 1024);
+        } else if (shb.sharded == 2)
+            avltree_sharded_init_hash(&shb.s, NSHARDS, 1, compar, hash);
+        else {
+            avltree_create(shb.t, 1, compar, NULL, NULL);
+            pthread_mutex_init(&shb.lock, NULL);
+        }
+        start = now();
+        for (i=0; i < NWRITERS; i++)
+            pthread_create(&writers[i], NULL, shard_writer, (void *)(size_t)(i + 1));
+        for (i=0; i < NWRITERS; i++)
+            pthread_join(writers[i], NULL);
+        printf("%s n=%d: %d writers: %.3f s", name[shb.sharded], n, NWRITERS, now() - start);
+        if (shb.sharded) {
+            for (total = 0, contended = 0, i=0; i < NSHARDS; i++) {
+                contended += shb.s.shard[i].contended;
+                total += shb.s.shard[i].t.nmemb;
+            }
+            /* The writers insert the same keys every time. */
+            assert(total == nmemb);
+            printf(", %lu contended", contended);
+            avltree_sharded_destroy(&shb.s);
+        } else {
+            nmemb = shb.t.nmemb;
+            avltree_destroy(shb.t);
+            pthread_mutex_destroy(&shb.lock);
+        }
+        printf("\n");
+    }
+    for (i=0; i < 1024; i++)
+        free(sample[i]);
+}
+
+/* Build two trees of N keys, union and free them on NTHREADS threads. */
+static void bench_par(n, nthreads)
+int n, nthreads;
+{
+    avltree_workers w;
+    avltree_tree a, b;
+    double start, build, set;
+    int i, *keys;
+
+    keys = malloc(sizeof(int) * 2 * n);
+    for (i=0; i < n; i++) {
+        keys[i] = 2 * i;
+        keys[n + i] = 2 * i + 1;
+    }
+    avltree_workers_init(&w, nthreads);
+    avltree_create(a, 1, compar, NULL, NULL);
+    avltree_create(b, 1, compar, NULL, NULL);
+    start = now();
+    avltree_par_build(&w.exec, &a, keys, NULL, n, sizeof(int));
+    avltree_par_build(&w.exec, &b, keys + n, NULL, n, sizeof(int));
+    build = now();
+    avltree_par_set_op(&w.exec, &a, &b, AVLTREE_UNION, AVLTREE_FREE_NONE);
+    set = now();
+    assert(a.nmemb == 2 * n && !b.nmemb);
+    avltree_par_free(&w.exec, &a, AVLTREE_FREE_NONE);
+    printf("parallel n=%d threads=%d: build %.3f s, union %.3f s, free %.3f s\n",
+           n, nthreads, build - start, set - build, now() - set);
+    avltree_workers_destroy(&w);
+    free(keys);
+}
+
+main(argc, argv)
+char **argv;
+{
+    int n, i;
+
+    /* bench.out par [n]: only the parallel operations, on 1 to 8 threads. */
+    if (argc > 1 && !strcmp(argv[1], "par")) {
+        n = argc > 2? atoi(argv[2]) : 10000000;
+        for (i=1; i <= 8; i *= 2)
+            bench_par(n, i);
+        return 0;
+    }
+    n = argc > 1? atoi(argv[1]) : 1000000;
+    printf("node size: %d bytes\n", (int)sizeof(avltree_node));
+    bench_insert(n, n, 0);
+    bench_insert(n, n, 1);
+    bench_insert(n, 1000, 1);
+    bench_upsert(n, 1000);
+    bench_traverse(n);
+    bench_build(n);
+    bench_batch(n, n / 10);
+    bench_batch(n, n);
+    bench_set(n);
+    bench_typed(n);
+    bench_frozen(n);
+    bench_frozen64(n);
+    bench_persistent(n);
+    bench_snapshot(n);
+    bench_mt(n);
+    bench_sharded(n);
+    bench_par(n, 1);
+    bench_par(n, 4);
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+    Benchmark suite: throughput and latency percentiles of avltree, with one
+    key or many per node, typed avltree, std::map and glibc tsearch (a red-black tree), over several key
+    distributions and sizes.
+    Copyright (C) 2025  João Manica
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+    more details.
+
+    suite.out [-j] [N ...] prints one CSV line, or with -j one JSON object,
+    per backend, distribution, size and operation. It fails if the backends
+    disagree on what the operations found.
+*/
+
+#define _GNU_SOURCE
+#include "avltree.h"
+#include <math.h>
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Every SAMPLE-th operation is timed on its own for the percentiles. */
+#define SAMPLE 64
+/* Keys read by a range scan. */
+#define SCAN 100
+
+typedef struct {
+    char *name;
+    void *(*create)(void);
+    void (*insert)(void *, int);
+    int (*find)(void *, int);
+    void (*remove)(void *, int);
+    /* Sums up to COUNT keys from the first >= KEY; NULL if unsupported. */
+    long (*scan)(void *, int, int);
+    void (*destroy)(void *);
+} backend;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* avltree, with keys allocated as users of the generic API do. */
+
+compar(x, y)
+const void *x, *y;
+{
+    return (*(int *)x > *(int *)y) - (*(int *)x < *(int *)y);
+}
+
+static void *avl_create()
+{
+    avltree_tree *t;
+
+    t = malloc(sizeof(avltree_tree));
+    avltree_create((*t), 1, compar, NULL, NULL);
+    return t;
+}
+
+/* The same API over wide nodes. */
+static void *wide_create()
+{
+    avltree_tree *t;
+
+    t = malloc(sizeof(avltree_tree));
+    avltree_create_wide((*t), 1, compar);
+    return t;
+}
+
+static void avl_insert(t, key)
+void *t;
+{
+    int *k;
+
+    k = malloc(sizeof(int));
+    *k = key;
+    avltree_insert_key_ptr((avltree_tree *)t, k);
+}
+
+static avl_find(t, key)
+void *t;
+{
+    return avltree_lookup(t, &key, NULL) != NULL;
+}
+
+static void avl_remove_key(t, key)
+void *t;
+{
+    avltree_remove(t, &key, AVLTREE_FREE_KEY);
+}
+
+static long avl_scan(t, key, count)
+void *t;
+{
+    avltree_node *n;
+    long sum;
+
+    sum = 0;
+    for (n = avl_lower_bound(t, ((avltree_tree *)t)->root, &key); n && count--; n = avl_next(n))
+        sum += *(int *)n->key;
+    return sum;
+}
+
+static void avl_destroy_tree(t)
+void *t;
+{
+    avltree_destroy_ptr(((avltree_tree *)t));
+    free(t);
+}
+
+/* Typed avltree, with the key inside the node. */
+
+AVLTREE_DEFINE(itree, int, AVLTREE_CMP)
+
+static void *typed_create()
+{
+    avltree_tree *t;
+
+    t = malloc(sizeof(avltree_tree));
+    itree_create(t, 1);
+    return t;
+}
+
+static void typed_insert(t, key)
+void *t;
+{
+    itree_insert(t, key, NULL);
+}
+
+static typed_find(t, key)
+void *t;
+{
+    return itree_find(t, key) != NULL;
+}
+
+static void typed_remove(t, key)
+void *t;
+{
+    itree_remove(t, key, AVLTREE_FREE_NONE);
+}
+
+static long typed_scan(t, key, count)
+void *t;
+{
+    itree_node *n;
+    long sum;
+
+    sum = 0;
+    for (n = itree_lower_bound(t, key); n && count--; n = (itree_node *)avl_next(&n->node))
+        sum += n->key;
+    return sum;
+}
+
+static void typed_destroy(t)
+void *t;
+{
+    itree_destroy(t, AVLTREE_FREE_NONE);
+    free(t);
+}
+
+/* std::map, in suite_map.cc. */
+
+void *map_create(void);
+void map_insert(void *, int);
+int map_find(void *, int);
+void map_remove(void *, int);
+long map_scan(void *, int, int);
+void map_destroy(void *);
+
+/* glibc tsearch(), a red-black tree. It has no range scan. */
+
+static void *rb_create()
+{
+    return calloc(1, sizeof(void *));
+}
+
+static void rb_insert(root, key)
+void *root;
+{
+    int *k, **found;
+
+    k = malloc(sizeof(int));
+    *k = key;
+    if (*(found = tsearch(k, root, compar)) != k)
+        free(k);
+}
+
+static rb_find(root, key)
+void *root;
+{
+    return tfind(&key, root, compar) != NULL;
+}
+
+static void rb_remove(root, key)
+void *root;
+{
+    int **found, *k;
+
+    if ((found = tfind(&key, root, compar))) {
+        k = *found;
+        tdelete(&key, root, compar);
+        free(k);
+    }
+}
+
+static void rb_destroy(root)
+void *root;
+{
+    tdestroy(*(void **)root, free);
+    free(root);
+}
+
+static backend backends[] = {
+    {"avltree", avl_create, avl_insert, avl_find, avl_remove_key, avl_scan, avl_destroy_tree},
+    {"avltree_wide", wide_create, avl_insert, avl_find, avl_remove_key, NULL, avl_destroy_tree},
+    {"avltree_typed", typed_create, typed_insert, typed_find, typed_remove, typed_scan, typed_destroy},
+    {"std::map", map_create, map_insert, map_find, map_remove, map_scan, map_destroy},
+    {"tsearch", rb_create, rb_insert, rb_find, rb_remove, NULL, rb_destroy},
+};
+
+/* Key distributions: */
+
+enum {SEQUENTIAL, RANDOM, ZIPFIAN, DUPLICATES, NDISTS};
+static char *dists[] = {"sequential", "random", "zipfian", "duplicates"};
+
+static unsigned long long rng;
+
+static unsigned long long rnd()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* A bijection of [0, 2^31), so distinct ranks give distinct keys. */
+static scramble(x)
+unsigned x;
+{
+    x = x * 0x9E3779B1u & 0x7fffffff;
+    x ^= x >> 15;
+    x = x * 0x85EBCA6Bu & 0x7fffffff;
+    x ^= x >> 13;
+    return x;
+}
+
+/* Zipfian ranks in [0, n) with skew 0.99, as in Gray et al., "Quickly
+   Generating Billion-Record Synthetic Databases". */
+#define THETA 0.99
+
+static struct {
+    int n;
+    double zetan, alpha, eta;
+} zipf;
+
+static void zipf_init(n)
+int n;
+{
+    double zeta2;
+    int i;
+
+    zipf.n = n;
+    for (zipf.zetan = 0, i=1; i <= n; i++)
+        zipf.zetan += 1 / pow(i, THETA);
+    zeta2 = 1 + 1 / pow(2, THETA);
+    zipf.alpha = 1 / (1 - THETA);
+    zipf.eta = (1 - pow(2.0 / n, 1 - THETA)) / (1 - zeta2 / zipf.zetan);
+}
+
+static zipf_rank()
+{
+    double u, uz;
+
+    u = (rnd() >> 11) * (1.0 / 9007199254740992.0);
+    uz = u * zipf.zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + pow(0.5, THETA))
+        return 1;
+    return (int)(zipf.n * pow(zipf.eta * u - zipf.eta + 1, zipf.alpha)) % zipf.n;
+}
+
+/* The Ith key inserted, or if !INSERT a key to look up, of N. */
+static draw(dist, n, i, insert)
+{
+    switch (dist) {
+    case SEQUENTIAL:
+        return insert? i : rnd() % n;
+    case RANDOM:
+        return scramble(insert? i : rnd() % n);
+    case ZIPFIAN:
+        return scramble(zipf_rank());
+    default:
+        /* Most inserts replace a key, as in the inplace mode. */
+        return rnd() % (n / 16 + 1);
+    }
+}
+
+/* Results: */
+
+static unsigned char json;
+static int rows;
+
+static dcompar(x, y)
+const void *x, *y;
+{
+    return (*(double *)x > *(double *)y) - (*(double *)x < *(double *)y);
+}
+
+/* Prints a row for OPS operations in SECS seconds, with percentiles of the
+   NLAT latencies in LAT. */
+static void report(b, dist, n, op, ops, secs, lat, nlat)
+backend *b;
+char *op;
+long ops;
+double secs, *lat;
+{
+    static double q[] = {0.5, 0.9, 0.99, 0.999, 1};
+    double p[5];
+    int i;
+
+    qsort(lat, nlat, sizeof(double), dcompar);
+    for (i=0; i < 5; i++)
+        p[i] = nlat? lat[(int)(q[i] * (nlat - 1))] * 1e9 : 0;
+    if (json)
+        printf("%s{\"backend\": \"%s\", \"dist\": \"%s\", \"n\": %d, \"op\": \"%s\", "
+               "\"ops\": %ld, \"seconds\": %.6f, \"mops\": %.3f, \"p50_ns\": %.0f, "
+               "\"p90_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f, \"max_ns\": %.0f}",
+               rows? ",\n" : "", b->name, dists[dist], n, op, ops, secs,
+               ops / secs / 1e6, p[0], p[1], p[2], p[3], p[4]);
+    else
+        printf("%s,%s,%d,%s,%ld,%.6f,%.3f,%.0f,%.0f,%.0f,%.0f,%.0f\n", b->name,
+               dists[dist], n, op, ops, secs, ops / secs / 1e6, p[0], p[1], p[2], p[3], p[4]);
+    rows++;
+}
+
+#define TIMED(I, OP) \
+    do { \
+        if ((I) % SAMPLE) \
+            OP; \
+        else { \
+            t0 = now(); \
+            OP; \
+            lat[nlat++] = now() - t0; \
+        } \
+    } while (0)
+
+/* What a run found, to compare between backends: */
+enum {FOUND, SCANNED, MIXED, LEFT, NRESULTS};
+static char *results[] = {"find", "scan", "mixed", "left"};
+
+/* Inserts N keys, looks them up, scans ranges, runs a mix of finds,
+   inserts and removes, removes half of the keys and destroys the rest.
+   Stores in RES what it found, or -1 for a scan the backend lacks. */
+static void run(b, dist, n, res)
+backend *b;
+long *res;
+{
+    double start, t0, *lat;
+    int i, nlat, *keys, *probe;
+    long sum;
+    void *h;
+
+    keys = malloc(sizeof(int) * n);
+    probe = malloc(sizeof(int) * n);
+    lat = malloc(sizeof(double) * (n / SAMPLE + 2));
+    rng = 88172645463325252ULL;
+    for (i=0; i < n; i++)
+        keys[i] = draw(dist, n, i, 1);
+    for (i=0; i < n; i++)
+        probe[i] = draw(dist, n, i, 0);
+    h = b->create();
+
+    nlat = 0;
+    start = now();
+    for (i=0; i < n; i++)
+        TIMED(i, b->insert(h, keys[i]));
+    report(b, dist, n, "insert", (long)n, now() - start, lat, nlat);
+
+    nlat = 0;
+    start = now();
+    for (sum = 0, i=0; i < n; i++)
+        TIMED(i, sum += b->find(h, probe[i]));
+    report(b, dist, n, "find", (long)n, now() - start, lat, nlat);
+    res[FOUND] = sum;
+
+    if (b->scan) {
+        nlat = 0;
+        start = now();
+        for (sum = 0, i=0; i < n / SCAN + 1; i++)
+            TIMED(i, sum += b->scan(h, probe[i], SCAN));
+        report(b, dist, n, "scan", (long)(n / SCAN + 1), now() - start, lat, nlat);
+        res[SCANNED] = sum;
+    } else
+        res[SCANNED] = -1;
+
+    /* Half finds, a quarter inserts, a quarter removes. */
+    nlat = 0;
+    start = now();
+    for (sum = 0, i=0; i < n; i++)
+        switch (i % 4) {
+        case 2:
+            TIMED(i, b->insert(h, probe[i]));
+            break;
+        case 3:
+            TIMED(i, b->remove(h, probe[i]));
+            break;
+        default:
+            TIMED(i, sum += b->find(h, probe[i]));
+        }
+    report(b, dist, n, "mixed", (long)n, now() - start, lat, nlat);
+    res[MIXED] = sum;
+
+    nlat = 0;
+    start = now();
+    for (i=0; i < n / 2; i++)
+        TIMED(i, b->remove(h, keys[i]));
+    report(b, dist, n, "remove", (long)(n / 2), now() - start, lat, nlat);
+    /* Not timed. */
+    for (sum = 0, i=0; i < n; i++)
+        sum += b->find(h, keys[i]);
+    res[LEFT] = sum;
+
+    start = now();
+    b->destroy(h);
+    lat[0] = now() - start;
+    report(b, dist, n, "destroy", 1L, lat[0], lat, 1);
+
+    free(keys);
+    free(probe);
+    free(lat);
+}
+
+main(argc, argv)
+char **argv;
+{
+    static int sizes[] = {1000, 10000, 100000, 1000000};
+    long res[NRESULTS], expect[NRESULTS];
+    int i, j, k, d, n, nsizes, *size;
+
+    size = malloc(sizeof(int) * (argc + 4));
+    for (nsizes = 0, i=1; i < argc; i++)
+        if (!strcmp(argv[i], "-j"))
+            json = 1;
+        else
+            size[nsizes++] = atoi(argv[i]);
+    if (!nsizes)
+        for (; nsizes < 4; nsizes++)
+            size[nsizes] = sizes[nsizes];
+    if (json)
+        printf("[\n");
+    else
+        printf("backend,dist,n,op,ops,seconds,mops,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    for (i=0; i < nsizes; i++) {
+        n = size[i];
+        zipf_init(n);
+        for (d = 0; d < NDISTS; d++)
+            for (j=0; j < sizeof(backends) / sizeof(backend); j++) {
+                run(&backends[j], d, n, res);
+                fflush(stdout);
+                for (k=0; k < NRESULTS; k++)
+                    if (!j || expect[k] < 0)
+                        expect[k] = res[k];
+                    else if (res[k] >= 0 && res[k] != expect[k]) {
+                        fprintf(stderr, "%s: %s %s %d: %ld, expected %ld\n",
+                                backends[j].name, dists[d], results[k], n, res[k], expect[k]);
+                        return 1;
+                    }
+            }
+    }
+    if (json)
+        printf("\n]\n");
+    free(size);
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+    std::map baseline for the benchmark suite.
+    Copyright (C) 2025  João Manica
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or any later version.
+
+    This program is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+    more details.
+*/
+
+#include <map>
+
+typedef std::map<int, void *> map;
+
+extern "C" {
+
+void *map_create()
+{
+    return new map;
+}
+
+void map_insert(void *m, int key)
+{
+    (*(map *)m)[key] = 0;
+}
+
+int map_find(void *m, int key)
+{
+    return ((map *)m)->find(key) != ((map *)m)->end();
+}
+
+void map_remove(void *m, int key)
+{
+    ((map *)m)->erase(key);
+}
+
+long map_scan(void *m, int key, int count)
+{
+    map::iterator i;
+    long sum;
+
+    sum = 0;
+    for (i = ((map *)m)->lower_bound(key); i != ((map *)m)->end() && count--; ++i)
+        sum += i->first;
+    return sum;
+}
+
+void map_destroy(void *m)
+{
+    delete (map *)m;
+}
+
+}
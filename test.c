@@ -12,19 +12,37 @@
     more details.
 */
 
-#include "avltree.h"
+#include "avltree_mt.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <time.h>
 
 #define TEST_AUTO
 
+#define STR_CMP(A, B) strcmp(A, B)
+
+AVLTREE_DEFINE(itree, int, AVLTREE_CMP)
+AVLTREE_DEFINE(stree, const char *, STR_CMP)
+
 compar(x, y)
 void *x, *y;
 {
     return *(int*)x-*(int*)y;
 }
+compar64(x, y)
+void *x, *y;
+{
+    return (*(int64_t*)x > *(int64_t*)y) - (*(int64_t*)x < *(int64_t*)y);
+}
+count_node(ctx, n)
+void *ctx;
+avltree_node *n;
+{
+    ++*(int*)ctx;
+    return 0;
+}
 void print_key(fp, k, v)
 FILE *fp;
 void *k, *v;
@@ -32,6 +50,1249 @@ void *k, *v;
     fprintf(fp, "%d", *(int*)k);
 }
 
+int *new_key(v)
+{
+    int *key;
+
+    key = malloc(sizeof(int));
+    *key = v;
+    return key;
+}
+/* A value, or NULL for nodes that keep none. */
+int *new_value(v)
+{
+#ifdef AVLTREE_NO_VALUE
+    return NULL;
+#else
+    return new_key(v);
+#endif
+}
+
+/* Checks the links, balance and order of t, and that it holds nmemb nodes;
+   with STRICT, no two keys are equal. */
+void check_tree(t, strict)
+avltree_tree *t;
+{
+    avltree_node *n, *prev;
+    int m;
+
+    assert(!t->root || !AVL_PARENT(t->root));
+    avl_height(stderr, t, t->root);
+    m = 0;
+    for (prev = NULL, n = avl_find_min(t, t->root); n; prev = n, n = avl_next(n)) {
+        assert(!n->child[0] || AVL_PARENT(n->child[0]) == n);
+        assert(!n->child[1] || AVL_PARENT(n->child[1]) == n);
+        assert(!prev || compar(prev->key, n->key) < !strict);
+        m++;
+    }
+    assert(m == t->nmemb);
+}
+
+void test_build()
+{
+    avltree_tree t;
+    void *keys[1000];
+    int ints[1000], i;
+
+    avltree_create(t, 1, compar, NULL, NULL);
+    assert(!avltree_build_sorted(&t, keys, NULL, 0, 0) && !t.root);
+    for (i=0; i < 1000; i++)
+        keys[i] = new_key(2*i);
+    assert(!avltree_build_sorted(&t, keys, NULL, 1000, 0));
+    check_tree(&t, 1);
+    assert(avltree_height(stderr, t) == 10);
+    /* Only into an empty tree. */
+    assert(avltree_build_sorted(&t, keys, NULL, 1000, 0));
+    for (i=0; i < 2000; i++)
+        assert((avltree_find_node(t, &i) == NULL) == i % 2);
+    avltree_destroy(t);
+
+    /* Keys in place, and all equal. */
+    avltree_create(t, 0, compar, NULL, NULL);
+    for (i=0; i < 1000; i++)
+        ints[i] = 7;
+    assert(!avltree_build_sorted(&t, ints, NULL, 1000, sizeof(int)));
+    check_tree(&t, 0);
+    assert(avltree_find_node(t, &ints[0]));
+    avltree_empty(t);
+}
+
+/* Builds a with the keys below 300 that are multiples of MA, and b with
+   those of MB; 0 leaves a tree empty. */
+void build_pair(a, b, ka, kb, ma, mb)
+avltree_tree *a, *b;
+int *ka, *kb;
+{
+    int i, na, nb;
+
+    avltree_create((*a), 1, compar, NULL, NULL);
+    avltree_create((*b), 1, compar, NULL, NULL);
+    for (na = nb = i = 0; i < 300; i++) {
+        if (ma && i % ma == 0)
+            ka[na++] = i;
+        if (mb && i % mb == 0)
+            kb[nb++] = i;
+    }
+    avltree_build_sorted(a, ka, NULL, na, sizeof(int));
+    avltree_build_sorted(b, kb, NULL, nb, sizeof(int));
+}
+
+void test_set_op()
+{
+    static unsigned char ops[] = {
+        AVLTREE_UNION, AVLTREE_INTERSECTION, AVLTREE_DIFFERENCE, AVLTREE_SYMDIFF
+    };
+    static int mods[][2] = {{2, 3}, {2, 0}, {0, 3}, {1, 1}};
+    avltree_tree a, b;
+    int ka[300], kb[300], i, o, m, move, in_a, in_b, keep, n;
+
+    for (o=0; o < 4; o++)
+        for (m=0; m < 4; m++)
+            for (move=0; move < 2; move++) {
+                build_pair(&a, &b, ka, kb, mods[m][0], mods[m][1]);
+                n = b.nmemb;
+                avl_set_op(&a, &b, ops[o], move, AVLTREE_FREE_NONE);
+                check_tree(&a, 1);
+                check_tree(&b, 1);
+                assert(move? !b.nmemb : b.nmemb == n);
+                for (n = i = 0; i < 300; i++) {
+                    in_a = mods[m][0] && i % mods[m][0] == 0;
+                    in_b = mods[m][1] && i % mods[m][1] == 0;
+                    keep = ops[o] & (in_a && in_b? AVLTREE_SET_BOTH :
+                                     in_a? AVLTREE_SET_TD : in_b? AVLTREE_SET_TS : 0);
+                    assert(!keep == !avltree_find_node(a, &i));
+                    n += !!keep;
+                }
+                assert(a.nmemb == n);
+                avltree_empty(a);
+                avltree_empty(b);
+            }
+    /* An empty result must release the pool of a. */
+    build_pair(&a, &b, ka, kb, 2, 2);
+    for (i=0; i < 150; i++)
+        kb[i]++;
+    avltree_intersection(a, b, 1, AVLTREE_FREE_NONE);
+    assert(!a.root && !a.nmemb && !a.own_alloc);
+    avltree_empty(a);
+}
+
+void test_split_join()
+{
+    avltree_tree t, l, r;
+    unsigned char in[1000];
+    int i, k, lo, hi, n, *key;
+
+    avltree_create(t, 1, compar, NULL, NULL);
+    for (i=0; i < 1000; i++)
+        if ((in[i] = rand() % 2))
+            avltree_insert_key(t, new_key(i));
+    for (k = -1; k <= 1000; k += 167) {
+        n = t.nmemb;
+        avltree_split(&t, &k, &l, &r);
+        check_tree(&l, 1);
+        check_tree(&r, 1);
+        assert(!t.root && l.nmemb + r.nmemb == n);
+        assert(!l.root || *(int *)avl_find_max(&l, l.root)->key < k);
+        assert(!r.root || *(int *)avl_find_min(&r, r.root)->key >= k);
+        /* Back through a new key when k is free, or without one. */
+        key = NULL;
+        if (k >= 0 && k < 1000 && !in[k]) {
+            key = new_key(k);
+            in[k] = 1;
+        }
+        avltree_join(&l, key, NULL, &r);
+        check_tree(&l, 1);
+        assert(!r.root && !r.nmemb && l.nmemb == n + !!key);
+        t = l;
+    }
+    /* Splitting into t itself. */
+    k = 500;
+    avltree_split(&t, &k, &t, &r);
+    avltree_join(&t, NULL, NULL, &r);
+    check_tree(&t, 1);
+    for (i=0; i < 20; i++) {
+        /* Open below every fifth time. */
+        lo = i % 5? rand() % 1100 - 50 : -1;
+        hi = lo + rand() % 200;
+        for (n = 0, k = lo; k < hi; k++)
+            if (k >= 0 && k < 1000 && in[k]) {
+                in[k] = 0;
+                n++;
+            }
+        assert(avltree_delete_range(t, i % 5? &lo : NULL, &hi, AVLTREE_FREE_BOTH) == n);
+        check_tree(&t, 1);
+    }
+    for (i=0; i < 1000; i++)
+        assert(!in[i] == !avltree_find_node(t, &i));
+    n = t.nmemb;
+    assert(avltree_delete_range(t, NULL, NULL, AVLTREE_FREE_BOTH) == n);
+    assert(!t.root && !t.nmemb);
+    assert(!avltree_delete_range(t, NULL, NULL, AVLTREE_FREE_BOTH));
+}
+
+void test_typed()
+{
+    static const char *words[] = {"pear", "apple", "fig", "kiwi", "apple"};
+    avltree_tree t;
+    unsigned char in[500];
+    itree_node *n;
+    int i, k, *value;
+
+    itree_create(&t, 1);
+    memset(in, 0, sizeof(in));
+    for (i=0; i < 5000; i++) {
+        k = rand() % 500;
+        if (rand() % 3) {
+#ifdef AVLTREE_NO_VALUE
+            value = NULL;
+#else
+            value = new_key(k);
+#endif
+            n = itree_insert(&t, k, value);
+            assert(n->key == k && AVL_VALUE(&n->node) == value);
+            in[k] = 1;
+        } else {
+            assert(itree_remove(&t, k, AVLTREE_FREE_VALUE) == !in[k]);
+            in[k] = 0;
+        }
+    }
+    check_tree(&t, 1);
+    for (k=0; k < 500; k++) {
+        assert(!itree_find(&t, k) == !in[k]);
+        n = itree_lower_bound(&t, k);
+        for (i = k; i < 500 && !in[i]; i++);
+        assert(i < 500? n && n->key == i : !n);
+    }
+    itree_destroy(&t, AVLTREE_FREE_VALUE);
+    assert(!t.root && !t.nmemb);
+
+    stree_create(&t, 1);
+    for (i=0; i < 5; i++)
+        stree_insert(&t, words[i], NULL);
+    assert(t.nmemb == 4);
+    assert(stree_find(&t, "fig") && !stree_find(&t, "plum"));
+    assert(!strcmp(stree_lower_bound(&t, "b")->key, "fig"));
+    assert(!strcmp(((stree_node *)avl_find_min(&t, t.root))->key, "apple"));
+    stree_destroy(&t, AVLTREE_FREE_NONE);
+}
+
+void test_compact()
+{
+#ifdef AVLTREE_COMPACT
+    avltree_node a, b;
+    int bf;
+
+    for (bf = -2; bf <= 2; bf++) {
+        AVL_SET_PARENT(&a, &b);
+        AVL_SET_BF(&a, bf);
+        assert(AVL_PARENT(&a) == &b && AVL_BF(&a) == bf);
+        AVL_SET_PARENT(&a, NULL);
+        assert(!AVL_PARENT(&a) && AVL_BF(&a) == bf);
+    }
+#if !defined(AVLTREE_SIZE) && !defined(AVLTREE_COUNT) && !defined(AVLTREE_AGG_TYPE)
+#ifdef AVLTREE_NO_VALUE
+    assert(sizeof(avltree_node) == 4 * sizeof(void *));
+#else
+    assert(sizeof(avltree_node) == 5 * sizeof(void *));
+#endif
+#endif
+#endif
+}
+
+count_key(ctx, k, v)
+void *ctx, *k, *v;
+{
+    ++*(int*)ctx;
+    return 0;
+}
+
+/* Compares snapshots of t, by pointer and by copy, with t itself. */
+void check_frozen(t)
+avltree_tree *t;
+{
+    avltree_frozen f;
+    avltree_node *n;
+    int i, k, size, m, lo, hi;
+
+    for (size = 0; size <= sizeof(int); size += sizeof(int)) {
+        assert(!avltree_freeze(t, &f, size));
+        assert(f.nmemb == t->nmemb);
+        for (i = avltree_frozen_first(&f), n = avl_find_min(t, t->root); n;
+             i = avltree_frozen_next(&f, i), n = avl_next(n)) {
+            assert(i && !compar(AVL_FROZEN_KEY(&f, i), n->key));
+            assert(AVL_FROZEN_VALUE(&f, i) == AVL_VALUE(n));
+        }
+        assert(!i);
+        for (k = -1; k <= 600; k++) {
+            i = avltree_frozen_find(&f, &k);
+            assert(!i == !avltree_find_node_ptr(t, &k));
+            assert(!i || !compar(AVL_FROZEN_KEY(&f, i), &k));
+            i = avltree_frozen_lower_bound(&f, &k);
+            n = avltree_lower_bound_ptr(t, &k);
+            assert(!i == !n && (!n || !compar(AVL_FROZEN_KEY(&f, i), n->key)));
+        }
+        lo = 100;
+        hi = 400;
+        m = i = 0;
+        avltree_range_ptr(t, &lo, &hi, count_node, &m);
+        avltree_frozen_range(&f, &lo, &hi, count_key, &i);
+        assert(i == m);
+        avltree_frozen_destroy(&f);
+    }
+}
+
+void test_frozen()
+{
+    avltree_tree t;
+    int i;
+
+    avltree_create(t, 1, compar, NULL, NULL);
+    check_frozen(&t);
+    for (i=0; i < 600; i++)
+        if (rand() % 2) {
+            avltree_insert_key(t, new_key(i));
+            if (t.nmemb == 1)
+                check_frozen(&t);
+        }
+    check_frozen(&t);
+    avltree_destroy(t);
+}
+
+void test_frozen64()
+{
+    static int sizes[] = {0, 1, 8, 9, 72, 1000};
+    avltree_tree t;
+    avltree_frozen64 f;
+    int64_t keys[1000], probes[3001], *key;
+    int out[3001], i, j, s, n;
+
+    for (s=0; s < 6; s++) {
+        n = sizes[s];
+        avltree_create(t, 1, compar64, NULL, NULL);
+        /* Sorted and spread over the whole range, ends included. */
+        for (i=0; i < n; i++) {
+            keys[i] = i == 0? INT64_MIN : i == n-1? INT64_MAX :
+                      INT64_MAX / (n-1) * (2*i - (n-1));
+            key = malloc(sizeof(int64_t));
+            *key = keys[i];
+            avltree_insert_key(t, key);
+        }
+        assert(!avltree_freeze64(&t, &f) && f.nmemb == n);
+        for (i=0; i < n; i++) {
+            probes[3*i] = keys[i];
+            probes[3*i+1] = keys[i] - (keys[i] != INT64_MIN);
+            probes[3*i+2] = keys[i] + (keys[i] != INT64_MAX);
+        }
+        probes[3*n] = INT64_MIN;
+        avltree_frozen64_find_batch(&f, probes, 3*n + 1, out);
+        for (i=0; i <= 3*n; i++) {
+            for (j=0; j < n && keys[j] < probes[i]; j++);
+            assert(avltree_frozen64_lower_bound(&f, probes[i]) == j);
+            assert(out[i] == avltree_frozen64_find(&f, probes[i]));
+            assert(out[i] == (j < n && keys[j] == probes[i]? j : -1));
+            assert(out[i] < 0 || f.values[out[i]] == NULL);
+        }
+        assert(avltree_frozen64_lower_bound(&f, INT64_MAX) == (n > 1? n-1 : n));
+        avltree_frozen64_destroy(&f);
+        avltree_destroy(t);
+    }
+}
+
+/* Same keys, values and shape of order as inserting one by one. */
+void test_batch()
+{
+    avltree_tree t, ref;
+    avltree_node *a, *b;
+    void *keys[400], *values[400];
+    int i, round, inplace, n, removed;
+
+    for (inplace = 0; inplace < 2; inplace++) {
+        avltree_create(t, inplace, compar, NULL, NULL);
+        avltree_create(ref, inplace, compar, NULL, NULL);
+        /* Into an empty tree, then into a full one. */
+        for (round = 0; round < 3; round++) {
+            n = round? 400 : 200;
+            for (i=0; i < n; i++) {
+                keys[i] = new_key(round == 2? i : rand() % 300);
+                values[i] = new_value(i);
+                avltree_insert(&ref, new_key(*(int *)keys[i]), new_value(i));
+            }
+            avltree_insert_batch(&t, keys, values, n);
+            check_tree(&t, inplace);
+            assert(t.nmemb == ref.nmemb);
+            for (a = avl_find_min(&t, t.root), b = avl_find_min(&ref, ref.root); a;
+                 a = avl_next(a), b = avl_next(b))
+                assert(!compar(a->key, b->key) &&
+                       (!AVL_HAS_VALUE(a) || !compar(AVL_VALUE(a), AVL_VALUE(b))));
+        }
+        avltree_insert_batch(&t, keys, values, 0);
+        for (removed = i = 0; i < 400; i++) {
+            keys[i] = new_key(rand() % 400);
+            removed += !avltree_remove(&ref, keys[i], AVLTREE_FREE_BOTH);
+        }
+        assert(avltree_remove_batch(&t, keys, 400, AVLTREE_FREE_BOTH) == removed);
+        check_tree(&t, inplace);
+        assert(t.nmemb == ref.nmemb);
+        for (a = avl_find_min(&t, t.root), b = avl_find_min(&ref, ref.root); a;
+             a = avl_next(a), b = avl_next(b))
+            assert(!compar(a->key, b->key));
+        for (i=0; i < 400; i++)
+            free(keys[i]);
+        avltree_destroy(t);
+        avltree_destroy(ref);
+    }
+}
+
+/* Readers search while a writer adds and removes the odd keys; the even
+   ones never leave. */
+struct mt_test {
+    avltree_mt t;
+    int stop;
+};
+
+void *mt_reader(arg)
+void *arg;
+{
+    struct mt_test *m;
+    avltree_mt_reader r;
+    void *key;
+    int i, k, found;
+
+    m = arg;
+    avltree_mt_reader_init(&m->t, &r);
+    for (i=0; !__atomic_load_n(&m->stop, __ATOMIC_ACQUIRE) || i < 1000; i++) {
+        k = rand() % 1000;
+        avltree_mt_enter(&m->t, &r);
+        found = avltree_mt_find(&m->t, &k, &key, NULL);
+        assert(found || k % 2);
+        assert(!found || *(int *)key == k);
+        assert(avltree_mt_lower_bound(&m->t, &k, &key, NULL) && *(int *)key >= k &&
+               *(int *)key <= k + 1);
+        avltree_mt_leave(&m->t, &r);
+    }
+    avltree_mt_reader_destroy(&m->t, &r);
+    return NULL;
+}
+
+void test_mt()
+{
+    struct mt_test m;
+    pthread_t readers[2];
+    unsigned char in[1001];
+    int i, k;
+
+    avltree_mt_init(&m.t, 1, compar);
+    m.stop = 0;
+    memset(in, 0, sizeof(in));
+    for (k=0; k <= 1000; k += 2) {
+        avltree_mt_insert(&m.t, new_key(k), NULL);
+        in[k] = 1;
+    }
+    for (i=0; i < 2; i++)
+        pthread_create(&readers[i], NULL, mt_reader, &m);
+    for (i=0; i < 20000; i++) {
+        k = rand() % 500 * 2 + 1;
+        if (rand() % 2) {
+            avltree_mt_insert(&m.t, new_key(k), new_value(k));
+            in[k] = 1;
+        } else {
+            assert(avltree_mt_remove(&m.t, &k, AVLTREE_FREE_BOTH) == !in[k]);
+            in[k] = 0;
+        }
+    }
+    __atomic_store_n(&m.stop, 1, __ATOMIC_RELEASE);
+    for (i=0; i < 2; i++)
+        pthread_join(readers[i], NULL);
+    check_tree(&m.t.t, 1);
+    for (k=0; k <= 1000; k++)
+        assert(!avltree_mt_find(&m.t, &k, NULL, NULL) == !in[k]);
+    avltree_mt_destroy(&m.t);
+}
+
+/* Checks order and balance below n; returns its height. */
+int check_pnode(n, lo, hi)
+avltree_pnode *n;
+int lo, hi;
+{
+    int lh, rh;
+
+    if (!n)
+        return 0;
+    assert(*(int *)n->key > lo && *(int *)n->key < hi && n->refs > 0);
+    lh = check_pnode(n->child[0], lo, *(int *)n->key);
+    rh = check_pnode(n->child[1], *(int *)n->key, hi);
+    assert(abs(lh - rh) <= 1 && n->height == (lh > rh? lh : rh) + 1);
+    return n->height;
+}
+
+void test_persistent()
+{
+    static int keys[200];
+    avltree_ptree v[11];
+    unsigned char in[11][200];
+    int i, j, k, m;
+
+    for (k=0; k < 200; k++)
+        keys[k] = k;
+    avltree_pcreate(v[0], 1, compar);
+    memset(in, 0, sizeof(in));
+    /* Each version makes 100 changes to the one before. */
+    for (i=0; i < 10; i++) {
+        avltree_psnapshot(&v[i+1], &v[i]);
+        memcpy(in[i+1], in[i], 200);
+        for (j=0; j < 100; j++) {
+            k = rand() % 200;
+            if (rand() % 3) {
+                avltree_pinsert(&v[i+1], &v[i+1], &keys[k], &keys[k]);
+                in[i+1][k] = 1;
+            } else {
+                assert(avltree_premove(&v[i+1], &v[i+1], &keys[k]) == !in[i+1][k]);
+                in[i+1][k] = 0;
+            }
+        }
+    }
+    for (i=0; i <= 10; i++) {
+        check_pnode(v[i].root, -1, 200);
+        for (m = k = 0; k < 200; k++) {
+            assert(!avltree_pfind(&v[i], &k) == !in[i][k]);
+            m += in[i][k];
+        }
+        assert(v[i].nmemb == m);
+        m = 0;
+        avltree_prange(&v[i], NULL, NULL, count_key, &m);
+        assert(m == v[i].nmemb);
+    }
+    /* Releasing the odd versions leaves the even ones whole. */
+    for (i=1; i <= 10; i += 2)
+        avltree_prelease(&v[i]);
+    for (i=0; i <= 10; i += 2) {
+        check_pnode(v[i].root, -1, 200);
+        for (k = 0; k < 200; k++)
+            assert(!avltree_pfind(&v[i], &k) == !in[i][k]);
+        avltree_prelease(&v[i]);
+    }
+}
+
+void sum_node(ctx, n)
+void *ctx;
+avltree_node *n;
+{
+    __atomic_fetch_add((long *)ctx, *(int *)n->key, __ATOMIC_RELAXED);
+}
+
+void test_par()
+{
+    static unsigned char ops[] = {
+        AVLTREE_UNION, AVLTREE_INTERSECTION, AVLTREE_DIFFERENCE, AVLTREE_SYMDIFF
+    };
+    static int sizes[] = {0, 1, 30000};
+    avltree_workers w;
+    avltree_tree a, b;
+    void **keys;
+    int *ints, i, o, s, n, in_a, in_b, keep;
+    long sum, expect;
+
+    assert(!avltree_workers_init(&w, 3));
+    keys = malloc(sizeof(void *) * 30000);
+    ints = malloc(sizeof(int) * 30000);
+    for (s=0; s < 3; s++) {
+        n = sizes[s];
+        for (expect = i = 0; i < n; i++) {
+            keys[i] = new_key(i);
+            ints[i] = i;
+            expect += i;
+        }
+        avltree_create(a, 1, compar, NULL, NULL);
+        avltree_create(b, 1, compar, NULL, NULL);
+        assert(!avltree_par_build(&w.exec, &a, keys, NULL, n, 0));
+        assert(!avltree_par_build(&w.exec, &b, ints, NULL, n, sizeof(int)));
+        check_tree(&a, 1);
+        check_tree(&b, 1);
+        sum = 0;
+        avltree_par_visit(&w.exec, &a, sum_node, &sum);
+        assert(sum == expect);
+        avltree_par_free(&w.exec, &a, AVLTREE_FREE_BOTH);
+        assert(!a.root && !a.nmemb);
+        avltree_empty(b);
+    }
+    /* Multiples of 2 against multiples of 3, on trees past the cutoffs. */
+    for (o=0; o < 4; o++) {
+        avltree_create(a, 1, compar, NULL, NULL);
+        avltree_create(b, 1, compar, NULL, NULL);
+        for (i=0; i < 30000; i++) {
+            if (i % 2 == 0)
+                avltree_insert_key(a, new_key(i));
+            if (i % 3 == 0)
+                avltree_insert_key(b, new_key(i));
+        }
+        avltree_par_set_op(&w.exec, &a, &b, ops[o], AVLTREE_FREE_BOTH);
+        check_tree(&a, 1);
+        assert(!b.root && !b.nmemb);
+        for (n = i = 0; i < 30000; i++) {
+            in_a = i % 2 == 0;
+            in_b = i % 3 == 0;
+            keep = ops[o] & (in_a && in_b? AVLTREE_SET_BOTH :
+                             in_a? AVLTREE_SET_TD : in_b? AVLTREE_SET_TS : 0);
+            assert(!keep == !avltree_find_node(a, &i));
+            n += !!keep;
+        }
+        assert(a.nmemb == n);
+        avltree_par_free(&w.exec, &a, AVLTREE_FREE_BOTH);
+    }
+    free(keys);
+    free(ints);
+    avltree_workers_destroy(&w);
+}
+
+unsigned long hash_int(k)
+const void *k;
+{
+    return *(int*)k * 2654435761u;
+}
+
+/* Checks that the shards of s are valid trees, each between its splitters,
+   and that iterating s yields its N keys in order. */
+void check_sharded(s, n)
+avltree_sharded *s;
+{
+    avltree_sharded_iter it;
+    avltree_node *node, *prev;
+    int i, m;
+
+    for (i=0; i < s->nshards; i++) {
+        check_tree(&s->shard[i].t, s->inplace);
+        if (s->hash || !s->shard[i].t.root)
+            continue;
+        /* Past a NULL splitter, every shard is empty. */
+        assert(!i || (s->split[i - 1] &&
+               compar(s->split[i - 1], avltree_find_min(s->shard[i].t)->key) <= 0));
+        assert(i == s->nshards - 1 || !s->split[i] ||
+               compar(avltree_find_max(s->shard[i].t)->key, s->split[i]) < 0);
+    }
+    m = 0;
+    for (prev = NULL, node = avltree_sharded_first(&it, s); node; prev = node, node = avltree_sharded_next(&it)) {
+        assert(!prev || compar(prev->key, node->key) < !s->inplace);
+        m++;
+    }
+    avltree_sharded_end(&it);
+    assert(m == n);
+}
+void test_sharded()
+{
+    static int dups[] = {1, 1, 1, 1, 1, 1, 1, 2, 3, 4, 5, 6};
+    avltree_sharded s;
+    void *keys[100], *k;
+    int i, h;
+
+    assert(avltree_sharded_init(&s, 4, 1, compar, 0));
+    /* A run of equal keys longer than a shard stays whole. */
+    assert(!avltree_sharded_init(&s, 4, 0, compar, sizeof(int)));
+    for (i=0; i < 12; i++)
+        avltree_sharded_insert(&s, new_key(dups[i]), NULL);
+    avltree_sharded_rebalance(&s);
+    check_sharded(&s, 12);
+    for (h = i = 0; i < 4; i++)
+        h += s.shard[i].t.root && *(int*)avltree_find_min(s.shard[i].t)->key == 1;
+    assert(h == 1);
+    for (i=1; i <= 6; i++)
+        assert(avltree_sharded_find(&s, &i, &k, NULL) && *(int*)k == i);
+    for (i=2; i <= 6; i++)
+        assert(!avltree_sharded_remove(&s, &i, AVLTREE_FREE_KEY));
+    avltree_sharded_rebalance(&s);
+    check_sharded(&s, 7);
+    avltree_sharded_destroy(&s);
+
+    /* Splitters outlive the keys they were copied from. */
+    assert(!avltree_sharded_init(&s, 4, 1, compar, sizeof(int)));
+    for (i=0; i < 100; i++)
+        keys[i] = &dups[i % 12];
+    avltree_sharded_sample(&s, keys, 100);
+    for (i=0; i < 1000; i++)
+        avltree_sharded_insert(&s, new_key(i), NULL);
+    avltree_sharded_rebalance(&s);
+    check_sharded(&s, 1000);
+    for (i=0; i < 1000; i += 2)
+        assert(!avltree_sharded_remove(&s, &i, AVLTREE_FREE_KEY));
+    for (i=0; i < 1000; i++)
+        assert(avltree_sharded_find(&s, &i, NULL, NULL) == i % 2);
+    avltree_sharded_rebalance(&s);
+    check_sharded(&s, 500);
+    for (i=1; i < 1000; i += 2)
+        assert(!avltree_sharded_remove(&s, &i, AVLTREE_FREE_KEY));
+    avltree_sharded_rebalance(&s);
+    check_sharded(&s, 0);
+    avltree_sharded_insert(&s, new_key(7), NULL);
+    i = 7;
+    assert(avltree_sharded_find(&s, &i, NULL, NULL));
+    check_sharded(&s, 1);
+    avltree_sharded_destroy(&s);
+
+    assert(!avltree_sharded_init_hash(&s, 4, 1, compar, hash_int));
+    for (i=0; i < 1000; i++)
+        avltree_sharded_insert(&s, new_key(i), NULL);
+    for (i=0; i < 1000; i += 2)
+        assert(!avltree_sharded_remove(&s, &i, AVLTREE_FREE_KEY));
+    for (i=0; i < 1000; i++)
+        assert(avltree_sharded_find(&s, &i, NULL, NULL) == i % 2);
+    check_sharded(&s, 500);
+    avltree_sharded_destroy(&s);
+}
+
+#ifdef AVLTREE_STATS
+static unsigned long ncalls;
+
+counted(x, y)
+void *x, *y;
+{
+    __atomic_add_fetch(&ncalls, 1, __ATOMIC_RELAXED);
+    return compar(x, y);
+}
+
+/* The counters against a counting compar, and the trees they describe. */
+void test_stats()
+{
+    avltree_workers w;
+    avltree_tree t, a, b;
+    avltree_stats st;
+    int i, n;
+
+    ncalls = 0;
+    avltree_create(t, 1, counted, NULL, NULL);
+    avltree_get_stats(&t, &st);
+    assert(!st.compar && !st.allocs && !st.height);
+    /* Sorted keys only rotate one way, and fill a perfect tree. */
+    for (i=0; i < 1023; i++)
+        avltree_insert_key(t, new_key(i));
+    avltree_get_stats(&t, &st);
+    assert(st.compar == ncalls && st.allocs == 1023 && !st.frees);
+    assert(st.single_rotations && !st.double_rotations);
+    assert(st.height == 10 && st.height == avl_height(stderr, &t, t.root));
+    assert(st.retrace_max <= st.retrace_steps && st.retrace_max <= 10);
+    avltree_stats_reset(&t);
+    ncalls = 0;
+    for (i=0; i < 1023; i++)
+        assert(avltree_find_node(t, &i));
+    avltree_get_stats(&t, &st);
+    assert(st.compar == ncalls && st.lookups == 1023);
+    assert(st.visited >= 1023 && st.visited <= 1023 * 10);
+    for (i=0; i < 1023; i += 2)
+        assert(!avltree_remove_node(t, &i, AVLTREE_FREE_BOTH));
+    avltree_get_stats(&t, &st);
+    assert(st.frees == 512 && !st.allocs);
+    assert(st.height == avl_height(stderr, &t, t.root));
+    avltree_destroy(t);
+    avltree_get_stats(&t, &st);
+    assert(st.frees == 1023 && !st.height);
+
+    /* Tasks of the parallel set operations count into the tree. */
+    assert(!avltree_workers_init(&w, 3));
+    for (i=0; i < 2; i++) {
+        avltree_create(a, 1, counted, NULL, NULL);
+        avltree_create(b, 1, counted, NULL, NULL);
+        for (n=0; n < 30000; n++) {
+            if (n % 2 == 0)
+                avltree_insert_key(a, new_key(n));
+            if (n % 3 == 0)
+                avltree_insert_key(b, new_key(n));
+        }
+        avltree_stats_reset(&a);
+        ncalls = 0;
+        avltree_par_set_op(i? &w.exec : NULL, &a, &b, AVLTREE_UNION, AVLTREE_FREE_BOTH);
+        avltree_get_stats(&a, &st);
+        assert(st.compar == ncalls);
+        assert(st.frees == 5000 && st.height == avl_height(stderr, &a, a.root));
+        avltree_destroy(a);
+    }
+    avltree_workers_destroy(&w);
+}
+#endif
+
+static const void *save_int(ctx, data, len)
+void *ctx, *data;
+size_t *len;
+{
+    *len = sizeof(int);
+    return data;
+}
+static void *load_int(ctx, data, len)
+void *ctx;
+const void *data;
+size_t len;
+{
+    assert(len == sizeof(int));
+    return new_key(*(int*)data);
+}
+
+/* Writes SIZE bytes of BUF to PATH. */
+void write_file(path, buf, size)
+char *path;
+void *buf;
+long size;
+{
+    FILE *f;
+
+    f = fopen(path, "wb");
+    assert(fwrite(buf, 1, size, f) == size);
+    fclose(f);
+}
+
+/* Whether both avltree_load() and avltree_map() take PATH. */
+int load_file(path)
+char *path;
+{
+    avltree_codec c = {save_int, save_int, load_int, load_int, NULL};
+    avltree_mapped m;
+    avltree_tree t;
+    int loaded, mapped;
+    FILE *f;
+
+    avltree_create(t, 1, compar, NULL, NULL);
+    f = fopen(path, "rb");
+    loaded = !avltree_load(&t, f, &c);
+    fclose(f);
+    if (loaded)
+        check_tree(&t, 1);
+    avltree_destroy(t);
+    if ((mapped = !avltree_map(&m, path, compar)))
+        avltree_unmap(&m);
+    assert(loaded == mapped);
+    return loaded;
+}
+
+void test_snapshot()
+{
+    static int sizes[] = {0, 1, 1000};
+    avltree_codec c = {save_int, save_int, load_int, load_int, NULL};
+    avltree_file_header *h;
+    avltree_record *rec;
+    avltree_mapped m;
+    avltree_tree t, u;
+    avltree_node *a, *b;
+    unsigned char *buf, *copy;
+    long size;
+    int i, j, k, n;
+    FILE *f;
+
+    for (j=0; j < 3; j++) {
+        n = sizes[j];
+        avltree_create(t, 1, compar, NULL, NULL);
+        for (i=0; i < n; i++)
+            avltree_insert(&t, new_key(i * 2), new_value(-i));
+        f = fopen("test.snapshot", "wb");
+        assert(!avltree_save(&t, f, &c));
+        fclose(f);
+        avltree_create(u, 1, compar, NULL, NULL);
+        f = fopen("test.snapshot", "rb");
+        assert(!avltree_load(&u, f, &c));
+        fclose(f);
+        check_tree(&u, 1);
+        /* The same keys, values and shape. */
+        assert(u.nmemb == n && avl_height(stderr, &u, u.root) == avl_height(stderr, &t, t.root));
+        for (a = avltree_find_min(t), b = avltree_find_min(u); a; a = avl_next(a), b = avl_next(b)) {
+            assert(!compar(a->key, b->key) && AVL_BF(a) == AVL_BF(b));
+            assert(!AVL_HAS_VALUE(a) || !compar(AVL_VALUE(a), AVL_VALUE(b)));
+        }
+        assert(!b);
+        assert(!avltree_map(&m, "test.snapshot", compar));
+        assert(m.nmemb == n);
+        for (i = -1; i <= 2 * n; i++)
+            if ((k = avltree_mapped_find(&m, &i)) >= 0)
+                assert(i % 2 == 0 && *(int*)AVL_MAPPED_KEY(&m, k) == i);
+            else
+                assert(i % 2 || i < 0 || i == 2 * n);
+        avltree_unmap(&m);
+        avltree_destroy(t);
+        avltree_destroy(u);
+    }
+
+    /* Every corruption of the records is rejected. */
+    f = fopen("test.snapshot", "rb");
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    buf = malloc(size);
+    copy = malloc(size);
+    assert(fread(buf, 1, size, f) == size);
+    fclose(f);
+    h = (avltree_file_header *)copy;
+    rec = (avltree_record *)(copy + sizeof(avltree_file_header));
+    assert(((avltree_file_header *)buf)->nmemb == 1000);
+    for (j=0; j < 10; j++) {
+        memcpy(copy, buf, size);
+        switch (j) {
+        case 0:
+            break;
+        case 1:
+            /* A key in the records. */
+            rec[5].key = sizeof(avltree_file_header);
+            break;
+        case 2:
+            rec[5].key = UINT64_MAX - 3;
+            break;
+        case 3:
+            rec[5].value_len = 1 << 20;
+            break;
+        case 4:
+            rec[5].bf = 2;
+            break;
+        case 5:
+            /* A record with two parents, and one with none. */
+            for (i=1; !rec[i].right; i++)
+                ;
+            rec[0].right = rec[i].right;
+            break;
+        case 6:
+            /* A cycle. */
+            for (i=1; !rec[i].right; i++)
+                ;
+            rec[i].right = i;
+            break;
+        case 7:
+            rec[999].left = 1;
+            break;
+        case 8:
+            h->nmemb = 999;
+            break;
+        default:
+            /* Data cut short. */
+            size -= 8;
+        }
+        write_file("test.snapshot", copy, size);
+        assert(load_file("test.snapshot") == (j == 0));
+    }
+    free(buf);
+    free(copy);
+    remove("test.snapshot");
+}
+
+/* Wide trees against counts of each key, as only point operations reach
+   their nodes. */
+void test_wide()
+{
+    static int cnt[2000], last[2000];
+    avltree_tree t;
+    void *k, *v;
+    int i, key, inplace, n;
+
+    for (inplace = 0; inplace < 2; inplace++) {
+        avltree_create_wide(t, inplace, compar);
+        i = 5;
+        assert(!avltree_lookup(&t, &i, NULL) && avltree_remove(&t, &i, AVLTREE_FREE_BOTH));
+        memset(cnt, 0, sizeof(cnt));
+        for (n = i = 0; i < 60000; i++) {
+            key = rand() % 2000;
+            if (rand() % 3) {
+                assert(!avltree_insert(&t, new_key(key), new_value(i)));
+                if (!inplace || !cnt[key]++)
+                    n++;
+                cnt[key] += !inplace;
+                last[key] = i;
+            } else {
+                assert(avltree_remove(&t, &key, AVLTREE_FREE_BOTH) == !cnt[key]);
+                if (cnt[key]) {
+                    cnt[key] = inplace? 0 : cnt[key] - 1;
+                    n--;
+                }
+            }
+            assert(t.nmemb == n);
+            if (i % 10000)
+                continue;
+            for (key = 0; key < 2000; key++) {
+                k = avltree_lookup(&t, &key, &v);
+                assert(!k == !cnt[key] && (!k || *(int*)k == key));
+                assert(!k || !inplace || !v || *(int*)v == last[key]);
+            }
+        }
+        avltree_destroy(t);
+        assert(!t.nmemb && !t.wroot);
+    }
+    /* Splits all the way up, then merges all the way down. */
+    avltree_create_wide(t, 1, compar);
+    for (i=0; i < 20000; i++)
+        avltree_insert(&t, new_key(i), NULL);
+    for (i = 20000 - 1; i >= 0; i--) {
+        assert(*(int*)avltree_lookup(&t, &i, NULL) == i);
+        assert(!avltree_remove(&t, &i, AVLTREE_FREE_KEY));
+        assert(!avltree_lookup(&t, &i, NULL) && t.nmemb == i);
+    }
+    assert(!t.wroot);
+    avltree_destroy(t);
+}
+
+#ifdef AVLTREE_COUNT
+/* Multisets through each way of inserting, against counts of each key. */
+void test_multiset()
+{
+    /* Occurrences left, and insertions into the concurrent tree, which
+       only removes whole keys. */
+    static int cnt[300], ins[300];
+    avltree_tree t, u;
+    avltree_mt m;
+    avltree_node *n;
+    itree_node *in;
+    int i, k, keys, total;
+
+    avltree_create(t, AVLTREE_MULTISET, compar, NULL, NULL);
+    itree_create(&u, AVLTREE_MULTISET);
+    avltree_mt_init(&m, AVLTREE_MULTISET, compar);
+    memset(cnt, 0, sizeof(cnt));
+    memset(ins, 0, sizeof(ins));
+    i = 7;
+    assert(!avltree_count(&t, &i) && avltree_remove_one(&t, &i, AVLTREE_FREE_BOTH));
+    for (keys = total = i = 0; i < 20000; i++) {
+        k = rand() % 300;
+        if (rand() % 4) {
+            avltree_insert_key(t, new_key(k));
+            in = itree_insert(&u, k, NULL);
+            assert(AVL_COUNT(&in->node) == cnt[k] + 1);
+            avltree_mt_insert(&m, new_key(k), NULL);
+            ins[k]++;
+            keys += !cnt[k]++;
+            total++;
+        } else if (cnt[k]) {
+            assert(!avltree_remove_one(&t, &k, AVLTREE_FREE_BOTH));
+            in = itree_find(&u, k);
+            assert(avltree_decrement(u, &in->node, AVLTREE_FREE_NONE) == cnt[k] - 1);
+            keys -= !--cnt[k];
+            total--;
+        }
+        assert(t.nmemb == keys && u.nmemb == keys);
+    }
+    check_tree(&t, 1);
+    check_tree(&u, 1);
+    check_tree(&m.t, 1);
+    for (i = k = 0; k < 300; k++) {
+        assert(avltree_count(&t, &k) == cnt[k] && avltree_count(&m.t, &k) == ins[k]);
+        in = itree_find(&u, k);
+        assert(in? AVL_COUNT(&in->node) == cnt[k] : !cnt[k]);
+#ifdef AVLTREE_SIZE
+        /* Ranges count occurrences. */
+        assert(avltree_count_range(t, NULL, &k) == i);
+#endif
+        i += cnt[k];
+    }
+    assert(i == total);
+    for (i = 0, n = avltree_find_min(t); n; n = avl_next(n))
+        i += AVL_COUNT(n);
+    assert(i == total);
+
+    /* A single key, inserted and removed many times. */
+    k = 5;
+    for (i=0; i < 1000; i++)
+        avltree_insert_key(t, new_key(k));
+    assert(avltree_count(&t, &k) == 1000 + cnt[k]);
+    for (i = cnt[k]; i < 1000 + cnt[k]; i++)
+        assert(!avltree_remove_one(&t, &k, AVLTREE_FREE_BOTH));
+    assert(avltree_count(&t, &k) == cnt[k]);
+    check_tree(&t, 1);
+    avltree_destroy(t);
+    itree_destroy(&u, AVLTREE_FREE_NONE);
+    avltree_mt_destroy(&m);
+}
+#endif
+
+struct upsert_test {
+    int made, updated, fail;
+};
+
+static void *make_count(ctx, probe, valuep)
+void *ctx, *probe, **valuep;
+{
+    struct upsert_test *u;
+
+    u = ctx;
+    if (u->fail)
+        return NULL;
+    u->made++;
+    *valuep = new_value(1);
+    return new_key(*(int*)probe);
+}
+static void add_count(ctx, n)
+void *ctx;
+avltree_node *n;
+{
+    ((struct upsert_test *)ctx)->updated++;
+    if (AVL_HAS_VALUE(n))
+        ++*(int*)AVL_VALUE(n);
+}
+
+/* Counting keys with avltree_upsert(), against counts of each key. */
+void test_upsert()
+{
+    /* Upserts of each key, and the value they should have left. */
+    static int cnt[500], val[500];
+    struct upsert_test u;
+    avltree_tree t;
+    avltree_node *n;
+    unsigned char inplace;
+    int i, k, keys, updates;
+
+    for (inplace = 1; inplace <= AVLTREE_MULTISET; inplace++) {
+        avltree_create(t, inplace, compar, NULL, NULL);
+        memset(&u, 0, sizeof(u));
+        memset(cnt, 0, sizeof(cnt));
+        /* A failed make_key leaves the tree as it was. */
+        u.fail = 1;
+        k = 3;
+        assert(!avltree_upsert(&t, &k, make_count, add_count, &u) && !t.root && !t.nmemb);
+        u.fail = 0;
+        for (updates = keys = i = 0; i < 20000; i++) {
+            /* The probe is on the stack: the tree must not keep it. */
+            k = rand() % 500;
+            n = avltree_upsert(&t, &k, make_count, i % 7? add_count : NULL, &u);
+            assert(n && *(int*)n->key == k && n->key != &k);
+            if (!cnt[k]++) {
+                keys++;
+                val[k] = 1;
+            } else if (i % 7) {
+                updates++;
+                val[k]++;
+            }
+            assert(t.nmemb == keys && u.made == keys && u.updated == updates);
+        }
+        check_tree(&t, 1);
+        for (k=0; k < 500; k++) {
+            n = avltree_find_node(t, &k);
+            assert(!n == !cnt[k]);
+            assert(!n || !AVL_HAS_VALUE(n) || *(int*)AVL_VALUE(n) == val[k]);
+#ifdef AVLTREE_COUNT
+            assert(!n || AVL_COUNT(n) == (inplace == AVLTREE_MULTISET? cnt[k] : 1));
+#endif
+        }
+        avltree_destroy(t);
+    }
+}
+
+#ifdef AVLTREE_AGG_TYPE
+static AVLTREE_AGG_TYPE lift_key(n)
+avltree_node *n;
+{
+    return (AVLTREE_AGG_TYPE)*(int*)n->key * AVL_COUNT(n);
+}
+static AVLTREE_AGG_TYPE lift_value(n)
+avltree_node *n;
+{
+    return AVL_HAS_VALUE(n)? *(int*)AVL_VALUE(n) : 0;
+}
+static AVLTREE_AGG_TYPE add(a, b)
+AVLTREE_AGG_TYPE a, b;
+{
+    return a + b;
+}
+/* The first key, for an aggregate that depends on the order of combine. */
+static AVLTREE_AGG_TYPE first(a, b)
+AVLTREE_AGG_TYPE a, b;
+{
+    return a < 0? b : a;
+}
+static AVLTREE_AGG_TYPE lift_first(n)
+avltree_node *n;
+{
+    return *(int*)n->key;
+}
+
+/* Aggregates of random ranges of t against occurrences CNT of keys in
+   [0, 1000); FIRST for the first key instead of the sum. */
+void check_aggregate(t, cnt, first)
+avltree_tree *t;
+int *cnt;
+{
+    AVLTREE_AGG_TYPE expect;
+    int i, k, lo, hi;
+
+    for (i=0; i < 8; i++) {
+        lo = i & 1? rand() % 1001 - 1 : -1;
+        hi = i & 2? rand() % 1001 : 1000;
+        for (expect = first? -1 : 0, k = lo < 0? 0 : lo; k < hi; k++)
+            if (cnt[k] && first) {
+                expect = k;
+                break;
+            } else
+                expect += (AVLTREE_AGG_TYPE)k * cnt[k];
+        assert(avl_range_aggregate(t, lo < 0? NULL : &lo, hi == 1000? NULL : &hi) == expect);
+    }
+    assert(!t->root || t->root->agg == avl_range_aggregate(t, NULL, NULL));
+}
+
+void test_aggregate()
+{
+    static int cnt[1000], left[1000], right[1000];
+    avltree_tree t, r;
+    void *keys[500];
+    int i, j, k;
+
+    avltree_create(t, AVLTREE_MULTISET, compar, NULL, NULL);
+    avltree_set_aggregate(&t, lift_key, add, 0);
+    memset(cnt, 0, sizeof(cnt));
+    check_aggregate(&t, cnt, 0);
+    for (i=0; i < 20000; i++) {
+        k = rand() % 1000;
+        if (rand() % 3) {
+            avltree_insert_key(t, new_key(k));
+#ifdef AVLTREE_COUNT
+            cnt[k]++;
+#else
+            cnt[k] = 1;
+#endif
+        } else if (cnt[k]) {
+            assert(!avltree_remove_node(t, &k, AVLTREE_FREE_BOTH));
+            cnt[k] = 0;
+        }
+        if (i % 500 == 0)
+            check_aggregate(&t, cnt, 0);
+    }
+    check_tree(&t, 1);
+    /* Recomputed for another aggregate, kept by split and join. */
+    avltree_set_aggregate(&t, lift_first, first, -1);
+    check_aggregate(&t, cnt, 1);
+    for (j=0; j < 10; j++) {
+        k = rand() % 1000;
+        avltree_split(&t, &k, &t, &r);
+        memcpy(left, cnt, sizeof(int) * k);
+        memset(left + k, 0, sizeof(int) * (1000 - k));
+        memset(right, 0, sizeof(int) * k);
+        memcpy(right + k, cnt + k, sizeof(int) * (1000 - k));
+        check_aggregate(&t, left, 1);
+        check_aggregate(&r, right, 1);
+        avltree_join(&t, NULL, NULL, &r);
+        check_aggregate(&t, cnt, 1);
+    }
+    avltree_set_aggregate(&t, lift_key, add, 0);
+    /* Batches of keys not in t. */
+    for (j = 0, k = 0; k < 1000 && j < 500; k++)
+        if (!cnt[k]) {
+            keys[j++] = new_key(k);
+            cnt[k] = 1;
+        }
+    avltree_insert_batch(&t, keys, NULL, j);
+    check_aggregate(&t, cnt, 0);
+    avltree_destroy(t);
+
+#ifndef AVLTREE_NO_VALUE
+    /* Values replaced on insertion, or changed in place. */
+    avltree_create(t, 1, compar, NULL, NULL);
+    avltree_set_aggregate(&t, lift_value, add, 0);
+    for (i=0; i < 1000; i++)
+        avltree_insert(&t, new_key(i % 100), new_key(i));
+    /* Each key keeps its last value, 900 + key. */
+    assert(avl_range_aggregate(&t, NULL, NULL) == 100 * 900 + 99 * 100 / 2);
+    for (k=0; k < 100; k++) {
+        ++*(int*)AVL_VALUE(avltree_find_node(t, &k));
+        avl_update_node(&t, avltree_find_node(t, &k));
+    }
+    k = 50;
+    assert(avl_range_aggregate(&t, NULL, &k) == 50 * 901 + 49 * 50 / 2);
+    avltree_destroy(t);
+    itree_create(&t, 1);
+    avltree_set_aggregate(&t, lift_value, add, 0);
+    for (i=0; i < 1000; i++)
+        itree_insert(&t, i % 100, new_key(i));
+    assert(avl_range_aggregate(&t, NULL, NULL) == 100 * 900 + 99 * 100 / 2);
+    itree_destroy(&t, AVLTREE_FREE_VALUE);
+#endif
+}
+#endif
+
 main()
 {
     avltree_tree t;
@@ -51,7 +1312,11 @@ main()
     int *queue;
     int i,j,m;
     avltree_tree removed;
+    avltree_pool pool;
+    avltree_cursor cur;
     avltree_create(removed, 1, compar, NULL, NULL);
+    avltree_pool_init(&pool, sizeof(avltree_node), 0, 0);
+    avltree_use_pool(removed, pool);
 
 #ifndef DEBUG    
     srand(time(NULL));
@@ -78,6 +1343,26 @@ main()
             putchar('\n');
 #endif
         }
+        /* Walk in order: */
+        m = 0;
+        for (avltree_cursor_first(&cur, &t); cur.node; avltree_cursor_next(&cur)) {
+            assert(!avl_prev(cur.node) || compar(avl_prev(cur.node)->key, cur.node->key) < 0);
+#ifdef AVLTREE_SIZE
+            assert(avltree_select(t, m) == cur.node);
+            assert(avltree_rank(t, cur.node->key) == m);
+#endif
+            m++;
+        }
+        assert(m == t.nmemb);
+        m = 0;
+        key = &queue[last];
+        avltree_range(t, NULL, key, count_node, &m);
+#ifdef AVLTREE_SIZE
+        assert(avltree_count_range(t, NULL, key) == m);
+#endif
+        assert(avltree_lower_bound(t, key) == avltree_find_node(t, key));
+        assert(avltree_floor(t, key) == avltree_lower_bound(t, key));
+        assert(avltree_upper_bound(t, key) == avl_next(avltree_find_node(t, key)));
         /* Sort in ascending order: */
         qsort(&queue[last], N, sizeof(int), compar);
         /* Remove M in this order (everything needs to be present): */
@@ -125,6 +1410,30 @@ main()
 #endif
         assert(!avltree_remove_node(t, &queue[last], AVLTREE_FREE_BOTH));
     }
+    test_build();
+    test_set_op();
+    test_split_join();
+    test_typed();
+    test_compact();
+    test_frozen();
+    test_frozen64();
+    test_batch();
+    test_mt();
+    test_persistent();
+    test_par();
+    test_sharded();
+    test_snapshot();
+    test_wide();
+#ifdef AVLTREE_COUNT
+    test_multiset();
+#endif
+    test_upsert();
+#ifdef AVLTREE_AGG_TYPE
+    test_aggregate();
+#endif
+#ifdef AVLTREE_STATS
+    test_stats();
+#endif
     /* Need to verify if happened any memory error. */
     avltree_destroy(removed);
     free(queue);